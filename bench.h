@@ -0,0 +1,23 @@
+/* Helpers shared by the benchmarks (timerbench, churnbench, loopbench)
+ * and the simulator. */
+
+#include <stdint.h>
+#include <time.h>
+
+/* The monotonic clock in nanoseconds, for timing runs */
+static inline uint64_t
+wall_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The byte at offset off in a test stream.  It depends on where in
+ * the stream it is, so a byte out of place shows up as well as one
+ * that's changed. */
+static inline uint8_t
+bench_pattern (uint64_t off)
+{
+  return off ^ off >> 8 ^ off >> 16;
+}
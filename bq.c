@@ -3,6 +3,9 @@
 #include <string.h>
 
 #include "bq.h"
+#include "pool.h"
+#include "probes.h"
+#include "slab.h"
 
 /* 
  * Private 
@@ -31,6 +34,50 @@ int bq_index_to_offset(bq_t* bq, int index)
     return index % bq->num_elements;
 }
 
+/* Where the buffered flags start in a queue's block of memory, and
+ * how big the whole block is.
+ */
+
+size_t bq_flags_offset(int num_elements, int element_size)
+{
+    return ((size_t)num_elements * element_size + sizeof(int) - 1)
+           & ~(sizeof(int) - 1);
+}
+
+size_t bq_arrays_size(int num_elements, int element_size)
+{
+    return bq_flags_offset(num_elements, element_size) + num_elements * sizeof(int);
+}
+
+/* Allocates the element buffer and the buffered flags together, as
+ * one zeroed block, from the payload slab when it's small enough, so a
+ * new queue usually doesn't cost a malloc at all. Returns the element
+ * buffer, and sets *buffered to the flags.
+ */
+
+void* bq_alloc_arrays(int num_elements, int element_size, int** buffered)
+{
+    size_t flags_off = bq_flags_offset(num_elements, element_size);
+    size_t size = bq_arrays_size(num_elements, element_size);
+
+    void* p = size <= SLAB_MAX ? slab_alloc(size) : malloc(size);
+    assert(p);
+    memset(p, 0, size);
+
+    *buffered = (int*)((char*)p + flags_off);
+    return p;
+}
+
+void bq_free_arrays(void* element_buffer, int num_elements, int element_size)
+{
+    size_t size = bq_arrays_size(num_elements, element_size);
+
+    if (size <= SLAB_MAX) slab_free(element_buffer);
+    else free(element_buffer);
+}
+
+pool_t bq_pool = POOL_INIT("bq_t", sizeof(bq_t));
+
 /* 
  * Public 
  */
@@ -44,13 +91,10 @@ bq_t* bq_new(int num_elements, int element_size)
     assert(num_elements > 0);
     assert(element_size > 0);
 
-    bq_t* bq = (bq_t*)malloc(sizeof(bq_t));
-    assert(bq);
+    bq_t* bq = pool_alloc(&bq_pool);
 
-    bq->element_buffer = calloc(num_elements, element_size);
-    assert(bq->element_buffer);
-    bq->element_buffered = calloc(num_elements, sizeof(int));
-    assert(bq->element_buffered);
+    bq->element_buffer = bq_alloc_arrays(num_elements, element_size,
+                                         &bq->element_buffered);
 
     bq->num_elements = num_elements;
     bq->element_size = element_size;
@@ -58,6 +102,9 @@ bq_t* bq_new(int num_elements, int element_size)
     bq->head = 0;
     bq->head_seq = 0;
 
+    bq->acct = NULL;
+    bq->acct_kind = 0;
+
     return bq;
 }
 
@@ -69,10 +116,9 @@ void bq_double_size(bq_t* bq)
 {
     assert(bq);
 
-    void* new_element_buffer = calloc(bq->num_elements * 2, bq->element_size);
-    assert(new_element_buffer);
-    int* new_element_buffered = calloc(bq->num_elements * 2, sizeof(int));
-    assert(new_element_buffered);
+    int* new_element_buffered;
+    void* new_element_buffer = bq_alloc_arrays(bq->num_elements * 2, bq->element_size,
+                                               &new_element_buffered);
 
     /* We have to move elements one at a time, because the modulo
      * indexing can mess things up if we just copy in a block. */
@@ -86,12 +132,18 @@ void bq_double_size(bq_t* bq)
         }
     }
 
-    free(bq->element_buffer);
-    free(bq->element_buffered);
+    bq_free_arrays(bq->element_buffer, bq->num_elements, bq->element_size);
+    if (bq->acct) {
+        mem_charge(bq->acct, bq->acct_kind,
+                   bq_arrays_size(bq->num_elements * 2, bq->element_size)
+                   - bq_arrays_size(bq->num_elements, bq->element_size));
+    }
 
     bq->element_buffer = new_element_buffer;
     bq->element_buffered = new_element_buffered;
     bq->num_elements = bq->num_elements*2;
+
+    PROBE2(bq_grow, bq, bq->num_elements);
 }
 
 /* Frees all the memory associated with a buffer queue.
@@ -101,12 +153,29 @@ int bq_destroy(bq_t* bq)
 {
     assert(bq);
 
-    free(bq->element_buffer);
-    free(bq->element_buffered);
-    free(bq);
+    if (bq->acct) {
+        mem_charge(bq->acct, bq->acct_kind,
+                   -(long)(sizeof(bq_t) + bq_arrays_size(bq->num_elements, bq->element_size)));
+    }
+    bq_free_arrays(bq->element_buffer, bq->num_elements, bq->element_size);
+    pool_free(&bq_pool, bq);
     return 0;
 }
 
+/* Starts charging the queue's memory, what it holds now and whatever
+ * it grows to, to kind in acct.
+ */
+
+void bq_account(bq_t* bq, memacct_t* acct, int kind)
+{
+    assert(bq);
+    assert(!bq->acct);
+
+    bq->acct = acct;
+    bq->acct_kind = kind;
+    mem_charge(acct, kind, sizeof(bq_t) + bq_arrays_size(bq->num_elements, bq->element_size));
+}
+
 /* memcpy's and element into the buffer queue at an index.
  * Assumes the element is a pointer to a block of memory that
  * is the size of an element in the buffer queue. Returns 0
@@ -156,6 +225,25 @@ void *bq_get_element(bq_t* bq, int index)
     return bq->element_buffer + (bq_index_to_offset(bq, index) * bq->element_size);
 }
 
+/* Returns a pointer to the element at index, and the length of the
+ * run of elements from there that don't wrap around the end of the
+ * memory segment, capped at the tail.
+ */
+
+void *bq_get_run(bq_t* bq, int index, int *n)
+{
+    assert(bq);
+    assert(n);
+    assert(bq_contains_index(bq, index));
+
+    int offset = bq_index_to_offset(bq, index);
+    int to_end = bq->num_elements - offset;
+    int to_tail = bq_get_tail_seq(bq) - index + 1;
+
+    *n = to_end < to_tail ? to_end : to_tail;
+    return bq->element_buffer + (offset * bq->element_size);
+}
+
 /* Returns the head index of the buffer queue abstraction (where
  * the infinite memory segment becomes real).
  */
@@ -205,3 +293,111 @@ int bq_increase_head_seq_to(bq_t* bq, int index)
 
     return 0;
 }
+
+/*
+ * Concurrent buffer queue
+ */
+
+/* Allocates a new concurrent buffer queue. Like bq_new, if any of the
+ * allocations fail, asserts will fail.
+ */
+
+cbq_t* cbq_new(int num_elements, int element_size)
+{
+    assert(num_elements > 0);
+    assert(element_size > 0);
+
+    cbq_t* cbq;
+    int err = posix_memalign((void**)&cbq, 64, sizeof(cbq_t));
+    assert(err == 0);
+
+    cbq->element_buffer = calloc(num_elements, element_size);
+    assert(cbq->element_buffer);
+
+    cbq->num_elements = num_elements;
+    cbq->element_size = element_size;
+
+    cbq->head = 0;
+    cbq->tail = 0;
+
+    return cbq;
+}
+
+/* Frees all the memory associated with a concurrent buffer queue. Both
+ * threads have to be done with it.
+ */
+
+int cbq_destroy(cbq_t* cbq)
+{
+    assert(cbq);
+
+    free(cbq->element_buffer);
+    free(cbq);
+    return 0;
+}
+
+/* Returns the free slot at the tail, or NULL if the consumer hasn't
+ * popped enough to make room. Only the producer may call this.
+ */
+
+void *cbq_reserve(cbq_t* cbq)
+{
+    assert(cbq);
+
+    unsigned int head = __atomic_load_n(&cbq->head, __ATOMIC_ACQUIRE);
+    if (cbq->tail - head >= (unsigned int)cbq->num_elements) return NULL;
+
+    return cbq->element_buffer + (cbq->tail % cbq->num_elements) * cbq->element_size;
+}
+
+/* Publishes the slot returned by cbq_reserve. The release store makes
+ * sure the consumer sees everything written into the slot before it
+ * sees the new tail.
+ */
+
+void cbq_push(cbq_t* cbq)
+{
+    assert(cbq);
+
+    __atomic_store_n(&cbq->tail, cbq->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns a pointer to the element index places past the head, or NULL
+ * if it hasn't been pushed yet. Only the consumer may call this.
+ */
+
+void *cbq_peek(cbq_t* cbq, int index)
+{
+    assert(cbq);
+    assert(index >= 0);
+
+    unsigned int tail = __atomic_load_n(&cbq->tail, __ATOMIC_ACQUIRE);
+    if (tail - cbq->head <= (unsigned int)index) return NULL;
+
+    return cbq->element_buffer + ((cbq->head + index) % cbq->num_elements) * cbq->element_size;
+}
+
+/* Hands count elements at the head back to the producer. The consumer
+ * must not touch them afterwards.
+ */
+
+void cbq_pop(cbq_t* cbq, int count)
+{
+    assert(cbq);
+    assert(count >= 0 && count <= cbq_count(cbq));
+
+    __atomic_store_n(&cbq->head, cbq->head + count, __ATOMIC_RELEASE);
+}
+
+/* Returns how many elements are queued, as seen from the calling
+ * thread.
+ */
+
+int cbq_count(cbq_t* cbq)
+{
+    assert(cbq);
+
+    unsigned int head = __atomic_load_n(&cbq->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = __atomic_load_n(&cbq->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
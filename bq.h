@@ -29,6 +29,8 @@
  *  | 6 | not yet accessible
  */
 
+#include "stats.h"
+
 typedef struct bq {
     void* element_buffer;
     int* element_buffered;
@@ -36,9 +38,14 @@ typedef struct bq {
     int element_size;
     int head;
     int head_seq;
+    memacct_t* acct;
+    int acct_kind;
 } bq_t;
 
-/* Create and destroy a buffer queue */
+/* Create and destroy a buffer queue. Queues come from a pool, and
+ * small ones keep their elements in the payload slab (see pool.h and
+ * slab.h), so a queue has to be destroyed by the thread that created
+ * it. */
 
 bq_t* bq_new(int num_elements, int element_size);
 int bq_destroy(bq_t* bq);
@@ -51,6 +58,14 @@ int bq_destroy(bq_t* bq);
 
 void bq_double_size(bq_t* bq);
 
+/**
+ * Charges the queue's memory, now and as it grows, to kind in acct
+ * (see stats.h), until it's destroyed. Doesn't count what the
+ * elements point to.
+ */
+
+void bq_account(bq_t* bq, memacct_t* acct, int kind);
+
 /**
  * Inserts an element into the queue at the requested index.
  * If that index is out of bounds, returns 0. Else overwrites
@@ -76,6 +91,15 @@ int bq_element_buffered(bq_t* bq, int index);
 
 void *bq_get_element(bq_t* bq, int index);
 
+/**
+ * Like bq_get_element, but also sets *n to how many elements from
+ * index on (up to the tail) sit one after another in memory, so they
+ * can be walked with a plain pointer. The rest start again at
+ * bq_get_run(bq, index + *n, ...). Doesn't check they're buffered.
+ */
+
+void *bq_get_run(bq_t* bq, int index, int *n);
+
 /**
  * Get the head and tail of the accessible memory addressed by the
  * queue abstraction.
@@ -90,3 +114,55 @@ int bq_get_tail_seq(bq_t* bq);
  */
 
 int bq_increase_head_seq_to(bq_t* bq, int index);
+
+/*
+ * CONCURRENT BUFFER QUEUE
+ *
+ * A fixed-size ring of elements shared by exactly one producer thread
+ * and one consumer thread, with no locks. The producer reserves the
+ * slot at the tail, fills it in place, and pushes it; the consumer
+ * peeks at elements from the head, and pops them once it's done with
+ * them. Slots are handed back and forth without memcpys, same as bq.
+ *
+ * The head is only ever written by the consumer, and the tail only by
+ * the producer, so each side just has to publish its own index after
+ * touching the memory it covers.
+ */
+
+typedef struct cbq {
+    void* element_buffer;
+    int num_elements;
+    int element_size;
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+} cbq_t;
+
+/* Create and destroy a concurrent buffer queue */
+
+cbq_t* cbq_new(int num_elements, int element_size);
+int cbq_destroy(cbq_t* cbq);
+
+/**
+ * Producer side. Reserve returns the slot at the tail to be filled,
+ * or NULL if the queue is full. Push makes the reserved slot visible
+ * to the consumer.
+ */
+
+void *cbq_reserve(cbq_t* cbq);
+void cbq_push(cbq_t* cbq);
+
+/**
+ * Consumer side. Peek returns the element index places past the head,
+ * or NULL if fewer than index + 1 elements are queued. Pop releases
+ * count elements from the head back to the producer.
+ */
+
+void *cbq_peek(cbq_t* cbq, int index);
+void cbq_pop(cbq_t* cbq, int count);
+
+/**
+ * Number of elements currently queued. Either side may call this, but
+ * the answer can be stale by the time it returns.
+ */
+
+int cbq_count(cbq_t* cbq);
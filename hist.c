@@ -0,0 +1,117 @@
+#include <assert.h>
+
+#include "hist.h"
+
+/*
+ * Private
+ */
+
+/* Returns the highest value bucket i holds.
+ */
+
+uint32_t hist_bucket_high(int i)
+{
+    assert(i >= 0 && i < HIST_BUCKETS);
+
+    if (i < HIST_SUB) return i;
+
+    int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+    return low + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+/*
+ * Public
+ */
+
+void hist_add(hist_t* to, const hist_t* from)
+{
+    assert(to);
+    assert(from);
+
+    int w;
+    for (w = 0; w < (HIST_BUCKETS + 63) / 64; w++) {
+        uint64_t used = from->used[w];
+        to->used[w] |= used;
+        while (used) {
+            int i = w * 64 + __builtin_ctzll(used);
+            to->bucket[i] += from->bucket[i];
+            used &= used - 1;
+        }
+    }
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+}
+
+void hist_add_atomic(hist_t* to, const hist_t* from)
+{
+    assert(to);
+    assert(from);
+
+    if (!from->count) return;
+
+    int w;
+    for (w = 0; w < (HIST_BUCKETS + 63) / 64; w++) {
+        uint64_t used = from->used[w];
+        if (!used) continue;
+        __atomic_or_fetch(&to->used[w], used, __ATOMIC_RELAXED);
+        while (used) {
+            int i = w * 64 + __builtin_ctzll(used);
+            __atomic_add_fetch(&to->bucket[i], from->bucket[i], __ATOMIC_RELAXED);
+            used &= used - 1;
+        }
+    }
+    __atomic_add_fetch(&to->count, from->count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&to->sum, from->sum, __ATOMIC_RELAXED);
+
+    uint32_t max = __atomic_load_n(&to->max, __ATOMIC_RELAXED);
+    while (from->max > max
+           && !__atomic_compare_exchange_n(&to->max, &max, from->max, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void hist_add_loaded(hist_t* to, const hist_t* from)
+{
+    assert(to);
+    assert(from);
+
+    int w;
+    for (w = 0; w < (HIST_BUCKETS + 63) / 64; w++) {
+        uint64_t used = __atomic_load_n(&from->used[w], __ATOMIC_RELAXED);
+        to->used[w] |= used;
+        while (used) {
+            int i = w * 64 + __builtin_ctzll(used);
+            to->bucket[i] += __atomic_load_n(&from->bucket[i], __ATOMIC_RELAXED);
+            used &= used - 1;
+        }
+    }
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+
+    uint32_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > to->max) to->max = max;
+}
+
+uint32_t hist_percentile(const hist_t* h, double q)
+{
+    assert(h);
+    assert(q >= 0 && q <= 1);
+
+    if (!h->count) return 0;
+
+    /* The rank of the value we want, rounded up, and at least 1 */
+
+    uint64_t rank = q * h->count, seen = 0;
+    if (rank < q * h->count || rank == 0) rank++;
+
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) break;
+    }
+    if (i == HIST_BUCKETS) return h->max;
+
+    uint32_t high = hist_bucket_high(i);
+    return high < h->max ? high : h->max;
+}
@@ -0,0 +1,86 @@
+/*
+ * LATENCY HISTOGRAMS
+ *
+ * Log-bucketed histograms in the style of HdrHistogram. Every power of
+ * two gets HIST_SUB equal-width buckets, so each bucket spans at most
+ * 1/HIST_SUB of the values it holds (12.5%), whatever their size:
+ *
+ *   values 0..7          one bucket each
+ *   values 8..15         one bucket each
+ *   values 16..31        buckets 2 wide
+ *   values 2^e..2^(e+1)  buckets 2^(e-3) wide
+ *
+ * Values are 32 bits, which is about 71 minutes in microseconds, and
+ * anything bigger is counted as the largest. Counts are 64 bits, so
+ * totals over every connection a long-running server has seen don't
+ * wrap. Recording is a bit scan and an increment, so it's fine to do
+ * per packet.
+ *
+ * A histogram belongs to one thread while it's being recorded into.
+ * Other threads can merge them with hist_add, and hist_add_atomic
+ * merges into one that several threads add to. A bitmap of the buckets
+ * in use lets merging skip the rest, which for a short connection is
+ * nearly all of them.
+ */
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint32_t max;
+    uint64_t bucket[HIST_BUCKETS];
+    uint64_t used[(HIST_BUCKETS + 63) / 64];	/* bit per non-empty bucket */
+} hist_t;
+
+/**
+ * Returns the bucket value falls in.
+ */
+
+static inline int hist_bucket(uint32_t value)
+{
+    if (value < HIST_SUB) return value;
+
+    int e = 31 - __builtin_clz(value);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB
+           + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * Counts one value, clamped to 32 bits.
+ */
+
+static inline void hist_record(hist_t* h, uint64_t value)
+{
+    uint32_t v = value > UINT32_MAX ? UINT32_MAX : value;
+    int b = hist_bucket(v);
+
+    h->bucket[b]++;
+    h->used[b / 64] |= (uint64_t)1 << (b % 64);
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/**
+ * Adds everything counted in from to to. The atomic version may be
+ * used by several threads on the same to at once, and hist_add_loaded
+ * reads a from that they may be adding to.
+ */
+
+void hist_add(hist_t* to, const hist_t* from);
+void hist_add_atomic(hist_t* to, const hist_t* from);
+void hist_add_loaded(hist_t* to, const hist_t* from);
+
+/**
+ * Returns the smallest value that at least fraction q (0 to 1) of the
+ * values counted are no bigger than, to within a bucket: the highest
+ * value its bucket holds, or the maximum seen if that's smaller. 0 if
+ * nothing's been counted.
+ */
+
+uint32_t hist_percentile(const hist_t* h, double q);
@@ -0,0 +1,385 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "impair.h"
+#include "pool.h"
+
+/*
+ * Private
+ */
+
+typedef struct impair_pkt {
+    uint64_t due;		/* ns */
+    uint64_t seq;		/* queued order, for ties */
+    void* dest;
+    size_t len;
+    char data[IMPAIR_MAX_PKT];
+} impair_pkt_t;
+
+struct impair {
+    impair_conf_t conf;
+    uint64_t rng[4];		/* xoshiro256** state */
+    int bad;			/* Gilbert-Elliott state */
+    uint64_t link_free;		/* when the cap has sent what it holds */
+    impair_pkt_t** heap;	/* earliest due first */
+    int nheap;
+    uint64_t seq;
+};
+
+static pool_t impair_pool = POOL_INIT("impair_pkt", sizeof(impair_pkt_t));
+
+static uint64_t splitmix64(uint64_t* x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t impair_rand(impair_t* im)
+{
+    uint64_t* s = im->rng;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/* Uniform in [0, 1) */
+
+static double impair_uniform(impair_t* im)
+{
+    return (impair_rand(im) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int impair_chance(impair_t* im, double p)
+{
+    return p > 0 && impair_uniform(im) < p;
+}
+
+/* How long this packet is delayed, in ns. Normal deviates are the sum
+ * of four uniform ones (Irwin-Hall), which is close enough and needs
+ * no libm. */
+
+static uint64_t impair_delay(impair_t* im)
+{
+    const impair_conf_t* c = &im->conf;
+    double d = c->delay;
+
+    if (c->jitter) {
+        double u;
+        if (c->dist == IMPAIR_NORMAL) {
+            u = impair_uniform(im) + impair_uniform(im)
+                + impair_uniform(im) + impair_uniform(im);
+            u = (u - 2) * 1.7320508075688772;
+        } else {
+            u = 2 * impair_uniform(im) - 1;
+        }
+        d += u * c->jitter;
+    }
+    return d > 0 ? (uint64_t)d : 0;
+}
+
+static int heap_before(const impair_pkt_t* a, const impair_pkt_t* b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void heap_push(impair_t* im, impair_pkt_t* p)
+{
+    int i = im->nheap++;
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heap_before(p, im->heap[parent])) break;
+        im->heap[i] = im->heap[parent];
+        i = parent;
+    }
+    im->heap[i] = p;
+}
+
+static impair_pkt_t* heap_pop(impair_t* im)
+{
+    impair_pkt_t* top = im->heap[0];
+    impair_pkt_t* last = im->heap[--im->nheap];
+    int i = 0;
+
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= im->nheap) break;
+        if (child + 1 < im->nheap && heap_before(im->heap[child + 1], im->heap[child])) {
+            child++;
+        }
+        if (!heap_before(im->heap[child], last)) break;
+        im->heap[i] = im->heap[child];
+        i = child;
+    }
+    if (im->nheap) im->heap[i] = last;
+    return top;
+}
+
+/* Queues a copy of pkt to leave at due, with a bit flipped if corrupt
+ * is set. Returns 0 if the queue is full. */
+
+static int impair_queue(impair_t* im, uint64_t due, void* dest,
+                        const void* pkt, size_t len, int corrupt)
+{
+    if (im->nheap == IMPAIR_MAX_QUEUED) return 0;
+
+    impair_pkt_t* p = pool_alloc(&impair_pool);
+    p->due = due;
+    p->seq = im->seq++;
+    p->dest = dest;
+    p->len = len;
+    memcpy(p->data, pkt, len);
+
+    if (corrupt) {
+        uint64_t bit = impair_rand(im) % (len * 8);
+        p->data[bit / 8] ^= 1 << (bit % 8);
+    }
+
+    heap_push(im, p);
+    return 1;
+}
+
+/* Parses a number with an optional suffix, scaled by scale */
+
+static int parse_num(const char* s, const char* suffix, double scale, double* out)
+{
+    char* end;
+    double v = strtod(s, &end);
+
+    if (end == s || v < 0) return -1;
+    if (*end && strcmp(end, suffix)) return -1;
+    *out = v * scale;
+    return 0;
+}
+
+/*
+ * Public
+ */
+
+int impair_parse(impair_conf_t* conf, const char* spec)
+{
+    assert(conf);
+    assert(spec);
+
+    char* copy = strdup(spec);
+    char* save = NULL;
+    char* item;
+    int ok = copy != NULL;
+
+    for (item = ok ? strtok_r(copy, ",", &save) : NULL; item && ok;
+         item = strtok_r(NULL, ",", &save)) {
+        char* val = strchr(item, '=');
+        double v;
+
+        if (!val) {
+            ok = 0;
+            break;
+        }
+        *val++ = '\0';
+
+        if (!strcmp(item, "loss")) {
+            ok = !parse_num(val, "%", 0.01, &conf->loss);
+        } else if (!strcmp(item, "dup")) {
+            ok = !parse_num(val, "%", 0.01, &conf->dup);
+        } else if (!strcmp(item, "corrupt")) {
+            ok = !parse_num(val, "%", 0.01, &conf->corrupt);
+        } else if (!strcmp(item, "reorder")) {
+            ok = !parse_num(val, "%", 0.01, &conf->reorder);
+        } else if (!strcmp(item, "burst")) {
+            char* r = strchr(val, '/');
+            char* h = r ? strchr(r + 1, '/') : NULL;
+            if (!r) {
+                ok = 0;
+                break;
+            }
+            *r++ = '\0';
+            if (h) *h++ = '\0';
+            conf->burst_loss = 1;
+            ok = !parse_num(val, "%", 0.01, &conf->burst_p)
+                 && !parse_num(r, "%", 0.01, &conf->burst_r)
+                 && (!h || !parse_num(h, "%", 0.01, &conf->burst_loss));
+        } else if (!strcmp(item, "delay")) {
+            ok = !parse_num(val, "ms", 1e6, &v);
+            if (ok) conf->delay = v;
+        } else if (!strcmp(item, "jitter")) {
+            ok = !parse_num(val, "ms", 1e6, &v);
+            if (ok) conf->jitter = v;
+        } else if (!strcmp(item, "dist")) {
+            if (!strcmp(val, "uniform")) {
+                conf->dist = IMPAIR_UNIFORM;
+            } else if (!strcmp(val, "normal")) {
+                conf->dist = IMPAIR_NORMAL;
+            } else {
+                ok = 0;
+            }
+        } else if (!strcmp(item, "rate")) {
+            ok = !parse_num(val, "", 1, &v);
+            if (ok) conf->rate = v;
+        } else if (!strcmp(item, "queue")) {
+            ok = !parse_num(val, "", 1, &v);
+            if (ok) conf->queue = v;
+        } else if (!strcmp(item, "seed")) {
+            conf->seed = strtoull(val, NULL, 0);
+        } else {
+            ok = 0;
+        }
+    }
+    free(copy);
+
+    if (!ok || conf->loss > 1 || conf->dup > 1 || conf->corrupt > 1
+        || conf->reorder > 1 || conf->burst_p > 1 || conf->burst_r > 1
+        || conf->burst_loss > 1) {
+        return -1;
+    }
+    return 0;
+}
+
+int impair_active(const impair_conf_t* conf)
+{
+    assert(conf);
+
+    return conf->loss > 0 || conf->burst_p > 0 || conf->dup > 0
+           || conf->corrupt > 0 || conf->delay || conf->jitter
+           || conf->rate;
+}
+
+impair_t* impair_new(const impair_conf_t* conf, uint64_t stream)
+{
+    assert(conf);
+
+    impair_t* im = calloc(1, sizeof(impair_t));
+    if (!im) return NULL;
+
+    im->heap = malloc(IMPAIR_MAX_QUEUED * sizeof(impair_pkt_t*));
+    if (!im->heap) {
+        free(im);
+        return NULL;
+    }
+    im->conf = *conf;
+    if (!im->conf.queue) im->conf.queue = 1 << 20;
+
+    uint64_t x = conf->seed ^ (stream * 0xd1b54a32d192ed03ULL);
+    int i;
+    for (i = 0; i < 4; i++) {
+        im->rng[i] = splitmix64(&x);
+    }
+    return im;
+}
+
+void impair_destroy(impair_t* im)
+{
+    assert(im);
+
+    while (im->nheap) {
+        pool_free(&impair_pool, heap_pop(im));
+    }
+    free(im->heap);
+    free(im);
+}
+
+int impair_packet(impair_t* im, uint64_t now, void* dest,
+                  const void* pkt, size_t len)
+{
+    assert(im);
+    assert(pkt);
+    assert(len <= IMPAIR_MAX_PKT);
+
+    const impair_conf_t* c = &im->conf;
+
+    /* Loss, in bursts if the state we're in says so */
+
+    double loss = c->loss;
+    if (c->burst_p > 0) {
+        if (im->bad) {
+            if (impair_chance(im, c->burst_r)) im->bad = 0;
+        } else {
+            if (impair_chance(im, c->burst_p)) im->bad = 1;
+        }
+        if (im->bad) loss = c->burst_loss;
+    }
+    if (impair_chance(im, loss)) return IMPAIR_DROP;
+
+    /* The bandwidth cap sends packets one after the other, and tail
+     * drops once the queue for it is full */
+
+    uint64_t leave = now;
+    if (c->rate) {
+        uint64_t start = im->link_free > now ? im->link_free : now;
+        if ((start - now) * (double)c->rate / 1e9 + len > c->queue) {
+            return IMPAIR_DROP;
+        }
+        im->link_free = start + len * 1000000000ULL / c->rate;
+        leave = im->link_free;
+    }
+
+    /* Each copy is delayed and corrupted on its own. One that's due
+     * now, as it is, can go straight out, unless that would overtake
+     * packets already due */
+
+    int copies = 1 + impair_chance(im, c->dup);
+    int send = 0, queued = 0;
+
+    while (copies--) {
+        uint64_t due = leave;
+        if ((c->delay || c->jitter) && !impair_chance(im, c->reorder)) {
+            due += impair_delay(im);
+        }
+        int corrupt = impair_chance(im, c->corrupt);
+        if (due <= now && !corrupt && !send && impair_next(im) > now) {
+            send = 1;
+        } else {
+            queued |= impair_queue(im, due, dest, pkt, len, corrupt);
+        }
+    }
+    return send ? IMPAIR_SEND : queued ? IMPAIR_QUEUED : IMPAIR_DROP;
+}
+
+uint64_t impair_next(impair_t* im)
+{
+    assert(im);
+
+    return im->nheap ? im->heap[0]->due : UINT64_MAX;
+}
+
+int impair_due(impair_t* im, uint64_t now, void** dest, void* buf)
+{
+    assert(im);
+    assert(dest);
+    assert(buf);
+
+    if (!im->nheap || im->heap[0]->due > now) return -1;
+
+    impair_pkt_t* p = heap_pop(im);
+    int len = p->len;
+
+    *dest = p->dest;
+    memcpy(buf, p->data, len);
+    pool_free(&impair_pool, p);
+    return len;
+}
+
+int impair_holds(impair_t* im, void* dest)
+{
+    assert(im);
+
+    int i;
+    for (i = 0; i < im->nheap; i++) {
+        if (im->heap[i]->dest == dest) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * NETWORK IMPAIRMENT
+ *
+ * Makes a link worse than loopback on purpose, in process, the way
+ * netem would: loss (independent, or in bursts following a
+ * Gilbert-Elliott model), delay with jitter, reordering, duplication,
+ * corruption and a bandwidth cap with a bounded queue. Every decision
+ * comes from an impair_t's own seeded generator, so the same seed and
+ * the same packets at the same times give the same result.
+ *
+ * Packets that aren't sent or lost right away wait in a heap ordered by
+ * when they're due to leave, which the caller drains with impair_due
+ * when impair_next says it's time. A packet is first held up by the
+ * bandwidth cap, if any, behind the ones before it, and then delayed.
+ * Reordered packets skip the delay, overtaking whatever's delayed, and
+ * jitter bigger than the gap between packets reorders them too.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IMPAIR_MAX_PKT 512	/* biggest packet there's room for */
+#define IMPAIR_MAX_QUEUED 65536	/* packets held at once, beyond which
+				   they're dropped */
+
+enum { IMPAIR_UNIFORM, IMPAIR_NORMAL };
+
+typedef struct impair_conf {
+    double loss;	/* chance a packet is lost (in the good state) */
+    double burst_p;	/* Gilbert-Elliott: chance of going from good */
+    double burst_r;	/* to bad, and back, per packet, 0 for no bursts */
+    double burst_loss;	/* chance of loss in the bad state */
+    double dup;		/* chance a packet is sent twice */
+    double corrupt;	/* chance a bit gets flipped */
+    double reorder;	/* chance a packet skips the delay */
+    uint64_t delay;	/* ns, on average */
+    uint64_t jitter;	/* ns either side (uniform) or std deviation */
+    int dist;		/* IMPAIR_UNIFORM or IMPAIR_NORMAL */
+    uint64_t rate;	/* bytes per second, 0 for no cap */
+    uint64_t queue;	/* bytes waiting for the cap before drops
+			   (1 MB if 0) */
+    uint64_t seed;
+} impair_conf_t;
+
+typedef struct impair impair_t;
+
+/* What became of a packet */
+
+enum {
+    IMPAIR_SEND,	/* send it now, as it is (a copy may be queued) */
+    IMPAIR_DROP,	/* it's lost */
+    IMPAIR_QUEUED	/* it's waiting for impair_due, maybe twice */
+};
+
+/**
+ * Parses a comma-separated list of impairments into conf, on top of
+ * what's there already. Each is key=value, where percentages may have
+ * a fraction and times are in milliseconds (also with a fraction):
+ *
+ *   loss=%  burst=p%/r%[/loss%]  dup=%  corrupt=%  reorder=%
+ *   delay=ms  jitter=ms  dist=uniform|normal  rate=bytes/s
+ *   queue=bytes  seed=n
+ *
+ * Returns -1 if spec doesn't make sense.
+ */
+
+int impair_parse(impair_conf_t* conf, const char* spec);
+
+/**
+ * Returns non-zero if conf does anything at all.
+ */
+
+int impair_active(const impair_conf_t* conf);
+
+/**
+ * Makes an impairment stage following conf, with its generator seeded
+ * from conf->seed and stream, so that each thread can have its own.
+ */
+
+impair_t* impair_new(const impair_conf_t* conf, uint64_t stream);
+void impair_destroy(impair_t* im);
+
+/**
+ * Decides what happens to the len byte packet pkt, sent to dest at
+ * time now (ns). Copies are made of anything that's queued, so pkt is
+ * the caller's again as soon as this returns.
+ */
+
+int impair_packet(impair_t* im, uint64_t now, void* dest,
+                  const void* pkt, size_t len);
+
+/**
+ * Returns the time the next queued packet is due, or UINT64_MAX if
+ * none is.
+ */
+
+uint64_t impair_next(impair_t* im);
+
+/**
+ * Takes the next packet due by now out of the queue, copying it to buf
+ * (IMPAIR_MAX_PKT bytes) and its destination to *dest. Returns its
+ * length, or -1 if nothing's due.
+ */
+
+int impair_due(impair_t* im, uint64_t now, void** dest, void* buf);
+
+/**
+ * Returns non-zero if anything is queued for dest, which had better not
+ * go away until it's all been sent.
+ */
+
+int impair_holds(impair_t* im, void* dest);
@@ -0,0 +1,220 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+/*
+ * Private
+ */
+
+typedef struct logbuf {
+    struct logbuf* next;
+    size_t len;
+    char data[LOGGER_BUF_SIZE];
+} logbuf_t;
+
+struct logger {
+    int fd;
+    int drop;			/* drop rather than block when out of buffers */
+    pthread_mutex_t lock;
+    pthread_cond_t work;	/* the thread waits here for full buffers */
+    pthread_cond_t space;	/* writers wait here for free ones */
+    logbuf_t* cur;		/* being filled, or NULL */
+    logbuf_t* full;		/* waiting for the disk, oldest first */
+    logbuf_t** full_tail;
+    logbuf_t* free;
+    int nbufs;			/* buffers allocated */
+    int stop;
+    int failed;			/* a write has failed, and been reported */
+    uint64_t dropped;		/* bytes (atomic) */
+    pthread_t thread;
+};
+
+/* Hands the current buffer to the thread. Called with the lock held. */
+
+static void logger_queue(logger_t* lg)
+{
+    lg->cur->next = NULL;
+    *lg->full_tail = lg->cur;
+    lg->full_tail = &lg->cur->next;
+    lg->cur = NULL;
+    pthread_cond_signal(&lg->work);
+}
+
+/* Makes a free buffer current, waiting for one unless we drop instead.
+ * Returns 0 if there isn't one. Called with the lock held. */
+
+static int logger_take(logger_t* lg)
+{
+    while (!lg->free) {
+        if (lg->nbufs < LOGGER_BUFFERS) {
+            logbuf_t* b = malloc(sizeof(logbuf_t));
+            if (b) {
+                b->next = NULL;
+                b->len = 0;
+                lg->free = b;
+                lg->nbufs++;
+                break;
+            }
+        }
+        if (lg->drop || lg->nbufs == 0) return 0;
+        pthread_cond_wait(&lg->space, &lg->lock);
+    }
+
+    lg->cur = lg->free;
+    lg->free = lg->cur->next;
+    return 1;
+}
+
+static void logger_flush(logger_t* lg, logbuf_t* b)
+{
+    size_t off = 0;
+
+    while (off < b->len) {
+        ssize_t n = write(lg->fd, b->data + off, b->len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (!lg->failed) perror("log write");
+            lg->failed = 1;
+            __atomic_add_fetch(&lg->dropped, b->len - off, __ATOMIC_RELAXED);
+            break;
+        }
+        off += n;
+    }
+}
+
+static void* logger_thread(void* arg)
+{
+    logger_t* lg = arg;
+
+    pthread_mutex_lock(&lg->lock);
+    while (1) {
+        if (!lg->full) {
+            int partial = lg->cur && lg->cur->len;
+
+            if (lg->stop) {
+                if (!partial) break;
+                logger_queue(lg);
+                continue;
+            }
+
+            /* Buffers that aren't filling up go out after a while */
+
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOGGER_LINGER_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000;
+            ts.tv_nsec %= 1000000000;
+            if (pthread_cond_timedwait(&lg->work, &lg->lock, &ts) == ETIMEDOUT
+                && !lg->full && lg->cur && lg->cur->len) {
+                logger_queue(lg);
+            }
+            continue;
+        }
+
+        logbuf_t* b = lg->full;
+        lg->full = b->next;
+        if (!lg->full) lg->full_tail = &lg->full;
+        pthread_mutex_unlock(&lg->lock);
+
+        logger_flush(lg, b);
+
+        pthread_mutex_lock(&lg->lock);
+        b->len = 0;
+        b->next = lg->free;
+        lg->free = b;
+        pthread_cond_broadcast(&lg->space);
+    }
+    pthread_mutex_unlock(&lg->lock);
+
+    return NULL;
+}
+
+/*
+ * Public
+ */
+
+logger_t* logger_open(int fd, int drop)
+{
+    assert(fd >= 0);
+
+    logger_t* lg = calloc(1, sizeof(logger_t));
+    if (!lg) return NULL;
+
+    lg->fd = fd;
+    lg->drop = drop;
+    lg->full_tail = &lg->full;
+    pthread_mutex_init(&lg->lock, NULL);
+    pthread_cond_init(&lg->work, NULL);
+    pthread_cond_init(&lg->space, NULL);
+
+    if ((errno = pthread_create(&lg->thread, NULL, logger_thread, lg))) {
+        pthread_cond_destroy(&lg->space);
+        pthread_cond_destroy(&lg->work);
+        pthread_mutex_destroy(&lg->lock);
+        free(lg);
+        return NULL;
+    }
+    return lg;
+}
+
+void logger_write(logger_t* lg, const void* buf, size_t n)
+{
+    assert(lg);
+    assert(buf || !n);
+
+    const char* p = buf;
+
+    pthread_mutex_lock(&lg->lock);
+    while (n > 0) {
+        if (!lg->cur && !logger_take(lg)) {
+            __atomic_add_fetch(&lg->dropped, n, __ATOMIC_RELAXED);
+            break;
+        }
+
+        size_t room = LOGGER_BUF_SIZE - lg->cur->len;
+        size_t k = n < room ? n : room;
+        memcpy(lg->cur->data + lg->cur->len, p, k);
+        lg->cur->len += k;
+        p += k;
+        n -= k;
+
+        if (lg->cur->len == LOGGER_BUF_SIZE) logger_queue(lg);
+    }
+    pthread_mutex_unlock(&lg->lock);
+}
+
+uint64_t logger_dropped(logger_t* lg)
+{
+    assert(lg);
+
+    return __atomic_load_n(&lg->dropped, __ATOMIC_RELAXED);
+}
+
+void logger_close(logger_t* lg)
+{
+    assert(lg);
+
+    pthread_mutex_lock(&lg->lock);
+    lg->stop = 1;
+    pthread_cond_signal(&lg->work);
+    pthread_mutex_unlock(&lg->lock);
+    pthread_join(lg->thread, NULL);
+
+    while (lg->free) {
+        logbuf_t* b = lg->free;
+        lg->free = b->next;
+        free(b);
+    }
+    close(lg->fd);
+    pthread_cond_destroy(&lg->space);
+    pthread_cond_destroy(&lg->work);
+    pthread_mutex_destroy(&lg->lock);
+    free(lg);
+}
@@ -0,0 +1,51 @@
+/*
+ * BUFFERED LOGS
+ *
+ * A logger copies what it's given into large buffers in memory, and a
+ * thread of its own writes the full ones out to a file descriptor, so
+ * logging costs a memcpy rather than a write per call, and never waits
+ * on the disk. Partly filled buffers are written once they've sat for
+ * LOGGER_LINGER_MS.
+ *
+ * Memory is bounded at LOGGER_BUFFERS buffers of LOGGER_BUF_SIZE bytes,
+ * allocated as they're needed. If all of them are waiting for the disk,
+ * logger_write either drops what it was given (counting the bytes) or
+ * blocks until one is free, as chosen by logger_open. Any number of
+ * threads may write to the same logger, with one short lock per call.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOGGER_BUF_SIZE (1 << 20)
+#define LOGGER_BUFFERS 8
+#define LOGGER_LINGER_MS 200
+
+typedef struct logger logger_t;
+
+/**
+ * Starts logging to fd, which the logger owns from now on, dropping
+ * data under pressure if drop is set or blocking if not. Returns NULL,
+ * with errno set, if the thread can't be started.
+ */
+
+logger_t* logger_open(int fd, int drop);
+
+/**
+ * Appends n bytes from buf to the log.
+ */
+
+void logger_write(logger_t* lg, const void* buf, size_t n);
+
+/**
+ * Returns how many bytes have been dropped so far.
+ */
+
+uint64_t logger_dropped(logger_t* lg);
+
+/**
+ * Writes out everything buffered, stops the thread and closes the file
+ * descriptor. Nothing may write to lg once this starts.
+ */
+
+void logger_close(logger_t* lg);
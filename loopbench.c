@@ -0,0 +1,641 @@
+/* End-to-end benchmark: real reliable processes talking over
+ * loopback, swept over windows, timeouts, payload patterns and
+ * impairments, with the results printed as JSON.
+ *
+ * Each run moves one stream from a writer to a reader through a pair
+ * of reliable processes, in one of two modes:
+ *
+ *   single   writer | reliable -S ... | reader, one connection each
+ *   cs       writer | uc | reliable -c ... reliable -s | uc -l | reader
+ *
+ * The writer sends a pattern that depends only on the offset, either
+ * in bulk (64 KB writes, as fast as the pipe takes them) or as small
+ * writes (256 bytes every 100 us, like an interactive program), and
+ * the reader checks every byte.  Statistics come from the sending
+ * side's -S file or control socket, and CPU time from the two
+ * reliable processes' rusage.  For each combination this reports:
+ *
+ *   goodput_Bps        payload bytes per second, first write to EOF
+ *   packets_per_s      data packets sent per second
+ *   retransmit_ratio   retransmissions over data packets sent
+ *   cpu_s_per_gb       user + system seconds, both processes, per 1e9
+ *                      bytes of payload
+ *   rtt_us, delivery_us  p50 and p99, from the sender's histograms
+ *
+ * Impairments (-I, separated by semicolons, "none" for none) are
+ * given to both processes with -I and a fixed seed, and each
+ * combination is run -r times with the median of every number kept,
+ * so results from different commits can be compared.  "make bench"
+ * runs the default sweep and labels it with the commit.
+ *
+ * usage: loopbench [-w windows] [-t timeouts] [-p patterns]
+ *                  [-I impairments] [-m modes] [-s bulk-bytes]
+ *                  [-n small-bytes] [-r repeats] [-e seed] [-l label]
+ *                  [-T limit] [-d bindir] */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define MAX_LIST 16
+#define BULK_WRITE 65536
+#define SMALL_WRITE 256
+#define SMALL_GAP_NS 100000
+#define START_MS 200		/* for the processes to bind their ports */
+
+enum { P_BULK, P_SMALL };
+enum { M_SINGLE, M_CS };
+static const char *pattern_names[] = { "bulk", "small" };
+static const char *mode_names[] = { "single", "cs" };
+
+static char *bindir = ".";
+static char reliable_bin[256], uc_bin[256];
+static char tmpdir[] = "/tmp/loopbench.XXXXXX";
+static unsigned long long seed = 1;
+static int limit = 120;		/* seconds a run may take */
+static int next_port;
+
+/* What one run measured */
+struct result {
+  double seconds;
+  double goodput_Bps;
+  double packets_per_s;
+  double retransmit_ratio;
+  double cpu_s_per_gb;
+  double rtt_p50, rtt_p99;
+  double delivery_p50, delivery_p99;
+};
+#define NRESULT (sizeof (struct result) / sizeof (double))
+
+static const char *result_names[NRESULT] = {
+  "seconds", "goodput_Bps", "packets_per_s", "retransmit_ratio",
+  "cpu_s_per_gb", "rtt_us_p50", "rtt_us_p99", "delivery_us_p50",
+  "delivery_us_p99"
+};
+
+static void
+sleep_ns (uint64_t ns)
+{
+  struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+  while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: loopbench [-w windows] [-t timeouts] [-p patterns]\n"
+	   "                 [-I impairments] [-m modes] [-s bulk-bytes]\n"
+	   "                 [-n small-bytes] [-r repeats] [-e seed]"
+	   " [-l label]\n"
+	   "                 [-T limit] [-d bindir]\n");
+  exit (1);
+}
+
+/* Splits s at each sep into at most MAX_LIST pieces */
+static int
+split (char *s, const char *sep, char **v)
+{
+  char *save = NULL, *p;
+  int n = 0;
+
+  for (p = strtok_r (s, sep, &save); p; p = strtok_r (NULL, sep, &save)) {
+    if (n == MAX_LIST)
+      usage ();
+    v[n++] = p;
+  }
+  if (!n)
+    usage ();
+  return n;
+}
+
+static int
+lookup (const char *s, const char **names, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    if (!strcmp (s, names[i]))
+      return i;
+  fprintf (stderr, "loopbench: unknown %s\n", s);
+  usage ();
+  return -1;
+}
+
+/* Writes size bytes of the pattern to fd, then exits */
+static void
+writer (int fd, int pat, unsigned long long size)
+{
+  static unsigned char buf[BULK_WRITE];
+  unsigned long long off = 0;
+  size_t chunk = pat == P_BULK ? BULK_WRITE : SMALL_WRITE;
+
+  signal (SIGPIPE, SIG_IGN);
+  while (off < size) {
+    size_t n = size - off < chunk ? size - off : chunk, i;
+    ssize_t r;
+    for (i = 0; i < n; i++)
+      buf[i] = bench_pattern (off + i);
+    for (i = 0; i < n; i += r)
+      if ((r = write (fd, buf + i, n - i)) < 0) {
+	perror ("loopbench: write");
+	_exit (1);
+      }
+    off += n;
+    if (pat == P_SMALL)
+      sleep_ns (SMALL_GAP_NS);
+  }
+  _exit (0);
+}
+
+/* Starts argv with the given stdin and stdout (-1 for /dev/null) and
+ * stderr to the file err, returning its pid */
+static pid_t
+spawn (char **argv, int in, int out, const char *err)
+{
+  pid_t pid = fork ();
+
+  if (pid < 0) {
+    perror ("loopbench: fork");
+    exit (1);
+  }
+  if (!pid) {
+    int null = open ("/dev/null", O_RDWR), e;
+    e = open (err, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2 (in >= 0 ? in : null, 0);
+    dup2 (out >= 0 ? out : null, 1);
+    dup2 (e >= 0 ? e : null, 2);
+    /* Nothing else of ours stays open in the child */
+    for (e = 3; e < 1024; e++)
+      close (e);
+    execv (argv[0], argv);
+    perror (argv[0]);
+    _exit (127);
+  }
+  return pid;
+}
+
+/* Asks the control socket at path for its JSON, into buf.  Returns -1,
+ * with errno set, if it can't. */
+static int
+control_query (const char *path, char *buf, size_t size)
+{
+  struct sockaddr_un sun;
+  size_t len = 0;
+  ssize_t r;
+  int s;
+
+  if (strlen (path) >= sizeof (sun.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset (&sun, 0, sizeof (sun));
+  sun.sun_family = AF_UNIX;
+  strcpy (sun.sun_path, path);
+  s = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0 || connect (s, (struct sockaddr *) &sun, sizeof (sun)) < 0
+      || write (s, "json\n", 5) != 5) {
+    if (s >= 0)
+      close (s);
+    return -1;
+  }
+  while (len < size - 1 && (r = read (s, buf + len, size - 1 - len)) > 0)
+    len += r;
+  buf[len] = '\0';
+  close (s);
+  return 0;
+}
+
+static int
+read_file (const char *path, char *buf, size_t size)
+{
+  int fd = open (path, O_RDONLY);
+  size_t len = 0;
+  ssize_t r;
+
+  if (fd < 0)
+    return -1;
+  while (len < size - 1 && (r = read (fd, buf + len, size - 1 - len)) > 0)
+    len += r;
+  buf[len] = '\0';
+  close (fd);
+  return 0;
+}
+
+/* Finds each of the keys in turn in json, and returns the number after
+ * the last, or -1.  The process totals and latency come before any
+ * connection's, so the first match is the one we want. */
+static double
+json_get (const char *json, const char *k1, const char *k2)
+{
+  const char *p = strstr (json, k1);
+
+  if (p && k2)
+    p = strstr (p, k2);
+  if (!p)
+    return -1;
+  p = strchr (p, ':');
+  return p ? strtod (p + 1, NULL) : -1;
+}
+
+static void
+show_errors (const char *name)
+{
+  char path[256], buf[4096];
+
+  snprintf (path, sizeof (path), "%s/%s.err", tmpdir, name);
+  if (!read_file (path, buf, sizeof (buf)) && *buf)
+    fprintf (stderr, "loopbench: %s said:\n%s", name, buf);
+}
+
+/* One run.  Returns 0 and fills in res if every byte arrived intact. */
+static int
+run (int mode, int pat, int window, int timeout, const char *impair,
+     unsigned long long size, struct result *res)
+{
+  char w[16], t[16], e[32], up[16], dn[16], updst[32], dndst[32];
+  char srv[256], cli[256], ctl[256], stats[256], err[256], json[65536];
+  char *argv[4][20];
+  pid_t pids[5], wpid = -1;
+  int npids = 0, rel[2], in[2], out[2], hold[2] = { -1, -1 }, i, a, ok = 1;
+  unsigned long long got = 0, bad = 0;
+  uint64_t start, end, deadline;
+  double cpu = 0;
+
+  snprintf (w, sizeof (w), "%d", window);
+  snprintf (t, sizeof (t), "%d", timeout);
+  snprintf (e, sizeof (e), "%llu", seed);
+  snprintf (up, sizeof (up), "%d", next_port);
+  snprintf (dn, sizeof (dn), "%d", next_port + 1);
+  snprintf (updst, sizeof (updst), "localhost:%d", next_port);
+  snprintf (dndst, sizeof (dndst), "localhost:%d", next_port + 1);
+  next_port += 2;
+  snprintf (srv, sizeof (srv), "%s/srv.sock", tmpdir);
+  snprintf (cli, sizeof (cli), "%s/cli.sock", tmpdir);
+  snprintf (ctl, sizeof (ctl), "%s/ctl.sock", tmpdir);
+  snprintf (stats, sizeof (stats), "%s/stats.json", tmpdir);
+  unlink (srv);
+  unlink (cli);
+  unlink (ctl);
+  unlink (stats);
+
+  /* Both reliable processes get the same options: argv[0] sends,
+   * argv[1] receives */
+  for (i = 0; i < 2; i++) {
+    a = 0;
+    argv[i][a++] = reliable_bin;
+    argv[i][a++] = "-w";
+    argv[i][a++] = w;
+    argv[i][a++] = "-t";
+    argv[i][a++] = t;
+    argv[i][a++] = "-e";
+    argv[i][a++] = e;
+    if (impair) {
+      argv[i][a++] = "-I";
+      argv[i][a++] = (char *) impair;
+    }
+    if (mode == M_SINGLE) {
+      if (!i) {
+	argv[i][a++] = "-S";
+	argv[i][a++] = stats;
+      }
+      argv[i][a++] = i ? dn : up;
+      argv[i][a++] = i ? updst : dndst;
+    }
+    else if (!i) {
+      argv[i][a++] = "-c";
+      argv[i][a++] = "-C";
+      argv[i][a++] = ctl;
+      argv[i][a++] = "-u";
+      argv[i][a++] = cli;
+      argv[i][a++] = dndst;
+    }
+    else {
+      argv[i][a++] = "-s";
+      argv[i][a++] = "-u";
+      argv[i][a++] = dn;
+      argv[i][a++] = srv;
+    }
+    argv[i][a] = NULL;
+    argv[i][0] = reliable_bin;
+  }
+
+  if (pipe (in) < 0 || pipe (out) < 0) {
+    perror ("loopbench: pipe");
+    exit (1);
+  }
+  fcntl (out[0], F_SETFD, FD_CLOEXEC);
+  fcntl (in[1], F_SETFD, FD_CLOEXEC);
+
+  /* Receivers first, so the first packet has somewhere to go.  In
+   * single mode, the receiving reliable's input is held open until
+   * the sender is up, or its EOF would find no one there. */
+  if (mode == M_SINGLE) {
+    if (pipe (hold) < 0) {
+      perror ("loopbench: pipe");
+      exit (1);
+    }
+    snprintf (err, sizeof (err), "%s/receiver.err", tmpdir);
+    rel[1] = pids[npids++] = spawn (argv[1], hold[0], out[1], err);
+    close (hold[0]);
+    snprintf (err, sizeof (err), "%s/sender.err", tmpdir);
+    rel[0] = pids[npids++] = spawn (argv[0], in[0], -1, err);
+  }
+  else {
+    argv[2][0] = uc_bin;
+    argv[2][1] = "-l";
+    argv[2][2] = "-u";
+    argv[2][3] = srv;
+    argv[2][4] = NULL;
+    snprintf (err, sizeof (err), "%s/uc-listen.err", tmpdir);
+    pids[npids++] = spawn (argv[2], -1, out[1], err);
+    snprintf (err, sizeof (err), "%s/server.err", tmpdir);
+    rel[1] = pids[npids++] = spawn (argv[1], -1, -1, err);
+    snprintf (err, sizeof (err), "%s/client.err", tmpdir);
+    rel[0] = pids[npids++] = spawn (argv[0], -1, -1, err);
+  }
+  close (out[1]);
+  sleep_ns (START_MS * 1000000ULL);
+
+  if (mode == M_CS) {
+    argv[3][0] = uc_bin;
+    argv[3][1] = "-u";
+    argv[3][2] = cli;
+    argv[3][3] = NULL;
+    snprintf (err, sizeof (err), "%s/uc.err", tmpdir);
+    pids[npids++] = spawn (argv[3], in[0], -1, err);
+  }
+  close (in[0]);
+
+  start = wall_ns ();
+  deadline = start + limit * 1000000000ULL;
+  if (!(wpid = fork ())) {
+    close (out[0]);
+    writer (in[1], pat, size);
+  }
+  close (in[1]);
+  if (hold[1] >= 0)
+    close (hold[1]);
+
+  /* Read and check everything that comes out the far end */
+  {
+    static unsigned char buf[65536];
+    struct pollfd pfd = { out[0], POLLIN, 0 };
+    ssize_t r;
+    size_t j;
+
+    while (1) {
+      uint64_t now = wall_ns ();
+      if (now >= deadline) {
+	fprintf (stderr, "loopbench: run took over %d s\n", limit);
+	ok = 0;
+	break;
+      }
+      if (poll (&pfd, 1, (deadline - now) / 1000000 + 1) <= 0)
+	continue;
+      if ((r = read (out[0], buf, sizeof (buf))) <= 0)
+	break;
+      for (j = 0; j < r; j++)
+	bad += buf[j] != bench_pattern (got + j);
+      got += r;
+    }
+    end = wall_ns ();
+    close (out[0]);
+  }
+  if (got != size || bad) {
+    fprintf (stderr, "loopbench: %llu of %llu bytes arrived, %llu wrong\n",
+	     got, size, bad);
+    ok = 0;
+  }
+
+  /* The client and server outlive the connection, so ask them now and
+   * then stop them; in single mode the sender writes its statistics
+   * as it exits */
+  *json = '\0';
+  if (mode == M_CS) {
+    if (ok && control_query (ctl, json, sizeof (json)) < 0) {
+      perror ("loopbench: control socket");
+      ok = 0;
+    }
+    kill (rel[0], SIGTERM);
+    kill (rel[1], SIGTERM);
+  }
+  if (!ok)
+    for (i = 0; i < npids; i++)
+      kill (pids[i], SIGKILL);
+  kill (wpid, SIGKILL);
+  waitpid (wpid, NULL, 0);
+
+  for (i = 0; i < npids; i++) {
+    struct rusage ru;
+    int status;
+
+    while (wait4 (pids[i], &status, 0, &ru) < 0 && errno == EINTR)
+      ;
+    if (pids[i] != rel[0] && pids[i] != rel[1])
+      continue;
+    cpu += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+      + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    if (mode == M_SINGLE && ok && (!WIFEXITED (status)
+				   || WEXITSTATUS (status))) {
+      fprintf (stderr, "loopbench: %s exited badly\n",
+	       pids[i] == rel[0] ? "sender" : "receiver");
+      ok = 0;
+    }
+  }
+  if (mode == M_SINGLE && ok && read_file (stats, json, sizeof (json)) < 0) {
+    perror (stats);
+    ok = 0;
+  }
+  if (!ok) {
+    show_errors (mode == M_SINGLE ? "sender" : "client");
+    show_errors (mode == M_SINGLE ? "receiver" : "server");
+  }
+  if (!ok)
+    return -1;
+
+  res->seconds = (end - start) / 1e9;
+  res->goodput_Bps = size / res->seconds;
+  res->packets_per_s = json_get (json, "\"packets_sent\"", NULL)
+    / res->seconds;
+  res->retransmit_ratio = json_get (json, "\"retransmits\"", NULL)
+    / json_get (json, "\"packets_sent\"", NULL);
+  res->cpu_s_per_gb = cpu / size * 1e9;
+  res->rtt_p50 = json_get (json, "\"rtt_us\"", "\"p50\"");
+  res->rtt_p99 = json_get (json, "\"rtt_us\"", "\"p99\"");
+  res->delivery_p50 = json_get (json, "\"delivery_us\"", "\"p50\"");
+  res->delivery_p99 = json_get (json, "\"delivery_us\"", "\"p99\"");
+  return 0;
+}
+
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void
+json_string (const char *s)
+{
+  putchar ('"');
+  for (; *s; s++)
+    if (*s == '"' || *s == '\\')
+      printf ("\\%c", *s);
+    else if ((unsigned char) *s >= ' ')
+      putchar (*s);
+  putchar ('"');
+}
+
+int
+main (int argc, char **argv)
+{
+  char *windows[MAX_LIST], *timeouts[MAX_LIST], *patterns[MAX_LIST];
+  char *impairs[MAX_LIST], *modes[MAX_LIST];
+  char wlist[] = "8,64", tlist[] = "50,200", plist[] = "bulk,small";
+  char ilist[] = "none;loss=0.5;delay=2,jitter=1", mlist[] = "single,cs";
+  int nw, nt, np, ni, nm, wi, ti, pi, ii, mi, i, k, opt, first = 1;
+  int repeats = 1, failed = 0;
+  unsigned long long bulk = 10000000, small = 500000;
+  const char *label = "";
+  char *wl = wlist, *tl = tlist, *pl = plist, *il = ilist, *ml = mlist;
+
+  while ((opt = getopt (argc, argv, "w:t:p:I:m:s:n:r:e:l:T:d:")) != -1)
+    switch (opt) {
+    case 'w':
+      wl = optarg;
+      break;
+    case 't':
+      tl = optarg;
+      break;
+    case 'p':
+      pl = optarg;
+      break;
+    case 'I':
+      il = optarg;
+      break;
+    case 'm':
+      ml = optarg;
+      break;
+    case 's':
+      bulk = strtoull (optarg, NULL, 0);
+      break;
+    case 'n':
+      small = strtoull (optarg, NULL, 0);
+      break;
+    case 'r':
+      repeats = atoi (optarg);
+      break;
+    case 'e':
+      seed = strtoull (optarg, NULL, 0);
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'T':
+      limit = atoi (optarg);
+      break;
+    case 'd':
+      bindir = optarg;
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc || repeats < 1 || limit < 1 || !bulk || !small)
+    usage ();
+  nw = split (wl, ",", windows);
+  nt = split (tl, ",", timeouts);
+  np = split (pl, ",", patterns);
+  ni = split (il, ";", impairs);
+  nm = split (ml, ",", modes);
+  for (i = 0; i < np; i++)
+    lookup (patterns[i], pattern_names, 2);
+  for (i = 0; i < nm; i++)
+    lookup (modes[i], mode_names, 2);
+
+  snprintf (reliable_bin, sizeof (reliable_bin), "%s/reliable", bindir);
+  snprintf (uc_bin, sizeof (uc_bin), "%s/uc", bindir);
+  if (!mkdtemp (tmpdir)) {
+    perror ("loopbench: mkdtemp");
+    exit (1);
+  }
+  signal (SIGPIPE, SIG_IGN);
+  next_port = 20000 + getpid () % 10000 * 4;
+
+  printf ("{\"label\":");
+  json_string (label);
+  printf (",\"cpus\":%ld,\"seed\":%llu,\"repeats\":%d,\"runs\":[",
+	  sysconf (_SC_NPROCESSORS_ONLN), seed, repeats);
+  fflush (stdout);
+
+  for (mi = 0; mi < nm; mi++)
+    for (pi = 0; pi < np; pi++)
+      for (ii = 0; ii < ni; ii++)
+	for (wi = 0; wi < nw; wi++)
+	  for (ti = 0; ti < nt; ti++) {
+	    int mode = lookup (modes[mi], mode_names, 2);
+	    int pat = lookup (patterns[pi], pattern_names, 2);
+	    int window = atoi (windows[wi]), timeout = atoi (timeouts[ti]);
+	    const char *impair = strcmp (impairs[ii], "none")
+	      ? impairs[ii] : NULL;
+	    unsigned long long size = pat == P_BULK ? bulk : small;
+	    struct result res[repeats];
+	    double v[repeats], med[NRESULT];
+	    int good = 0;
+
+	    fprintf (stderr, "loopbench: %s %s %s window %d timeout %d\n",
+		     modes[mi], patterns[pi], impairs[ii], window, timeout);
+	    for (k = 0; k < repeats; k++)
+	      if (!run (mode, pat, window, timeout, impair, size, &res[good]))
+		good++;
+
+	    /* The median of each number, on its own */
+	    for (i = 0; i < NRESULT; i++) {
+	      for (k = 0; k < good; k++)
+		v[k] = ((double *) &res[k])[i];
+	      qsort (v, good, sizeof (double), cmp_double);
+	      med[i] = good ? v[good / 2] : 0;
+	    }
+
+	    printf ("%s\n{\"mode\":\"%s\",\"pattern\":\"%s\",\"impair\":",
+		    first ? "" : ",", modes[mi], patterns[pi]);
+	    json_string (impairs[ii]);
+	    printf (",\"window\":%d,\"timeout_ms\":%d,\"bytes\":%llu,"
+		    "\"ok\":%s", window, timeout, size,
+		    good == repeats ? "true" : "false");
+	    for (i = 0; i < NRESULT; i++)
+	      printf (",\"%s\":%.9g", result_names[i], med[i]);
+	    printf ("}");
+	    fflush (stdout);
+	    first = 0;
+	    failed |= good != repeats;
+	  }
+  printf ("\n]}\n");
+
+  {
+    char path[256];
+    const char *names[] = { "srv.sock", "cli.sock", "ctl.sock",
+      "stats.json", "sender.err", "receiver.err", "uc-listen.err",
+      "server.err", "client.err", "uc.err"
+    };
+    for (i = 0; i < sizeof (names) / sizeof (names[0]); i++) {
+      snprintf (path, sizeof (path), "%s/%s", tmpdir, names[i]);
+      unlink (path);
+    }
+    rmdir (tmpdir);
+  }
+  return failed;
+}
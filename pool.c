@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+
+#if DMALLOC && !POOL_MALLOC
+#define POOL_MALLOC 1
+#endif
+
+/*
+ * Private
+ */
+
+#define POOL_MAX 32		/* pools in one program */
+#define POOL_ALIGN 16
+
+static pool_t* pools[POOL_MAX];
+static int npools;
+static int hugepages;
+
+/* Each thread's free lists, indexed by pool id, and what's left of its
+ * current arena. A free object holds the pointer to the next one. */
+
+static __thread void* free_lists[POOL_MAX];
+static __thread char* arena;
+static __thread size_t arena_left;
+
+/* Returns a pool's free list index, giving it one (and registering it
+ * for pool_stats) on first use. Two threads can race to do that, in
+ * which case the loser's index just goes unused.
+ */
+
+static int pool_id(pool_t* pool)
+{
+    int id = __atomic_load_n(&pool->id, __ATOMIC_ACQUIRE);
+    if (id) return id - 1;
+
+    int new_id = __atomic_fetch_add(&npools, 1, __ATOMIC_RELAXED);
+    assert(new_id < POOL_MAX);
+    pools[new_id] = pool;
+
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&pool->id, &expected, new_id + 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pools[new_id] = NULL;
+        return expected - 1;
+    }
+    return new_id;
+}
+
+/* Maps a new arena for this thread, in huge pages if we've been asked
+ * to and can get them. Whatever was left of the old one is abandoned.
+ */
+
+static void pool_new_arena(void)
+{
+    void* p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (__atomic_load_n(&hugepages, __ATOMIC_RELAXED))
+        p = mmap(NULL, POOL_ARENA, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+        p = mmap(NULL, POOL_ARENA, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    assert(p != MAP_FAILED);
+
+    arena = p;
+    arena_left = POOL_ARENA;
+}
+
+/*
+ * Public
+ */
+
+void* pool_alloc(pool_t* pool)
+{
+    assert(pool);
+
+    __atomic_fetch_add(&pool->allocs, 1, __ATOMIC_RELAXED);
+
+#if POOL_MALLOC
+    pool_id(pool);
+    void* m = malloc(pool->size);
+    assert(m);
+    return m;
+#else
+    int id = pool_id(pool);
+    void* p = free_lists[id];
+    if (p) {
+        free_lists[id] = *(void**)p;
+        return p;
+    }
+
+    size_t size = (pool->size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    assert(size <= POOL_ARENA);
+    if (arena_left < size) pool_new_arena();
+
+    p = arena;
+    arena += size;
+    arena_left -= size;
+    return p;
+#endif
+}
+
+void pool_free(pool_t* pool, void* p)
+{
+    assert(pool);
+
+    if (!p) return;
+
+    __atomic_fetch_add(&pool->frees, 1, __ATOMIC_RELAXED);
+
+#if POOL_MALLOC
+    free(p);
+#else
+    int id = pool_id(pool);
+    *(void**)p = free_lists[id];
+    free_lists[id] = p;
+#endif
+}
+
+void pool_use_hugepages(void)
+{
+    __atomic_store_n(&hugepages, 1, __ATOMIC_RELAXED);
+}
+
+void pool_stats(FILE* out)
+{
+    int i, n = __atomic_load_n(&npools, __ATOMIC_RELAXED);
+
+    for (i = 0; i < n && i < POOL_MAX; i++) {
+        pool_t* pool = pools[i];
+        if (!pool) continue;
+
+        unsigned long allocs = __atomic_load_n(&pool->allocs, __ATOMIC_RELAXED);
+        unsigned long frees = __atomic_load_n(&pool->frees, __ATOMIC_RELAXED);
+        fprintf(out, "pool %-8s size %5zu  allocs %10lu  frees %10lu  in use %8lu\n",
+                pool->name, pool->size, allocs, frees, allocs - frees);
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * OBJECT POOLS
+ *
+ * Free lists of fixed-size objects, one pool per type, for everything
+ * that gets allocated and freed with each connection: rel_t, conn_t,
+ * bq_t and output chunks. A freed object goes back on its pool's free
+ * list for the current thread instead of to malloc, and new objects
+ * are carved off the thread's current arena, a POOL_ARENA byte block
+ * from mmap. After pool_use_hugepages, arenas are asked for in huge
+ * pages first, falling back to ordinary pages if the kernel has none
+ * to give.
+ *
+ * Like the payload slab, arenas are never handed back, and an object
+ * has to be freed by the thread that allocated it.
+ *
+ * Every pool counts the objects allocated and freed, across all
+ * threads, for pool_stats. Building with POOL_MALLOC (or DMALLOC)
+ * turns the pools into plain malloc and free, keeping the counts.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define POOL_ARENA (2 * 1024 * 1024)
+
+typedef struct pool {
+    const char* name;
+    size_t size;
+    int id;			/* free list index + 1, 0 until first use */
+    unsigned long allocs;	/* updated atomically */
+    unsigned long frees;
+} pool_t;
+
+/* Define a pool statically, with POOL_INIT("name", sizeof(type)) */
+
+#define POOL_INIT(name, size) { (name), (size), 0, 0, 0 }
+
+/**
+ * Returns a new object, not zeroed. Asserts if memory runs out.
+ */
+
+void* pool_alloc(pool_t* pool);
+
+/**
+ * Puts an object back on this thread's free list.
+ */
+
+void pool_free(pool_t* pool, void* p);
+
+/**
+ * Back arenas allocated from now on with huge pages where possible.
+ */
+
+void pool_use_hugepages(void);
+
+/**
+ * Writes a line per pool that's been used: name, object size, and
+ * the objects allocated, freed and still in use.
+ */
+
+void pool_stats(FILE* out);
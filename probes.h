@@ -0,0 +1,41 @@
+/*
+ * STATIC TRACEPOINTS
+ *
+ * PROBEn(name, ...) marks a protocol event with n arguments, for perf,
+ * bpftrace or systemtap to attach to as USDT probe "reliable:name".
+ * Built with -DPROBES=1 (see PROBES_CFLAGS in the Makefile) they come
+ * from <sys/sdt.h>: each is a nop where it stands, plus a note in the
+ * binary saying where its arguments can be found, and costs nothing
+ * more until a tracer attaches. Otherwise they are gone altogether,
+ * and their arguments aren't even evaluated.
+ *
+ *   recvpkt(rel_t*, size_t n)          a packet arrives, before it's checked
+ *   ack_advance(rel_t*, from, to)      an ack moves the send window from
+ *                                      one head seqno to another (or not,
+ *                                      if it's a duplicate)
+ *   send(rel_t*, seqno, len)           first transmission of a packet
+ *   retransmit(rel_t*, seqno, count)   and every one after that
+ *   nagle_defer(rel_t*, seqno)         Nagle holds a small packet back
+ *   deliver(rel_t*, seqno, bytes)      payload goes to conn_output
+ *   bq_grow(bq_t*, elements)           a buffer queue doubles to elements
+ *
+ * For example:
+ *
+ *   bpftrace -e 'usdt:./reliable:reliable:retransmit { @[arg2] = count(); }'
+ */
+
+#if PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(reliable, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(reliable, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(reliable, name, a, b, c)
+
+#else
+
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+
+#endif
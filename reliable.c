@@ -15,9 +15,31 @@
 
 #include "rlib.h"
 #include "bq.h"
+#include "slab.h"
+#include "pool.h"
+#include "probes.h"
 
 #define SEND_BUFFER_INITIAL_SIZE 1
 
+/* Paced packets go out in bursts of up to this many, and an idle
+ * connection may send this many back-to-back before pacing kicks in */
+#define PACE_BURST 4
+
+/* Transmissions are shared out between connections by deficit round
+ * robin: a connection may send SCHED_QUANTUM data packets per turn,
+ * and all of them together at most SCHED_BUDGET per pass of the
+ * event loop.  Whatever doesn't fit waits in the backlog for
+ * rel_timer, which rlib runs again right away. */
+#define SCHED_QUANTUM 8
+#define SCHED_BUDGET 64
+
+/* What rel_output returns: whether it sent a new ack, or whether
+ * delivering an EOF finished the connection off, in which case r has
+ * been destroyed and must not be touched again */
+#define REL_OUT_IDLE 0
+#define REL_OUT_ACKED 1
+#define REL_OUT_DESTROYED 2
+
 
 struct reliable_state {
     rel_t *next;	/* Linked list for traversing all connections */
@@ -35,16 +57,43 @@ struct reliable_state {
     int window;
     int single_connection;
 
-    /* Buffer queue for sending and receiving */
+    /* Input is a mapped file, so only read as far as the send window */
+
+    int input_mapped;
+
+    /* Output is a file, so payloads are written straight into place,
+     * and sink_off is the file offset of the head of rec_bq. Packets
+     * that arrive ahead of it go in 500 byte slots counted from
+     * sink_org_seq at sink_org_off; see rel_sink_place */
+
+    int output_sink;
+    long long sink_off;
+    int sink_org_seq;
+    long long sink_org_off;
+
+    /* Buffer queue for sending and receiving. rec_bq holds pointers
+     * to packets in the payload slab (rec_element_t's, or
+     * rec_sink_element_t's in sink mode), and outside sink mode only
+     * exists while rec_held packets are waiting to be printed; see
+     * rel_rec_hold. In sink mode it always exists, and rec_held counts
+     * what's in it. */
 
     bq_t *send_bq;
     bq_t *rec_bq;
+    int rec_held;
 
     /* State for sending and receiving */
 
     int seqno;
     int ackno;
 
+    /* Lowest seqno that has never been sent. Everything in the send
+     * queue below it has gone out at least once, so refilling the
+     * window after an ack only has to look from here. The packets read
+     * but not ack'd are always head..seqno-1, so no count is kept. */
+
+    int unsent;
+
     /* Connection teardown state */
 
     int read_eof;
@@ -54,15 +103,105 @@ struct reliable_state {
     /* Nagle state */
 
     int nagle_outstanding;
+
+    /* Pacing state: pace is as in config_common, srtt is the smoothed
+     * round trip time in ns (0 until measured), and pace_next is when
+     * the next data packet is allowed out */
+
+    long pace;
+    uint64_t srtt;
+    uint64_t pace_next;
+
+    /* Scheduler state: deficit is how many more packets we may send
+     * this turn, granted in the loop pass grant_pass unless we are in
+     * the backlog, in which case only the round robin grants more */
+
+    int deficit;
+    uint64_t grant_pass;
+    int backlogged;
+    rel_t *sched_next;
+    rel_t **sched_prev;
+
+    /* On the active list, which rel_timer walks instead of rel_list */
+
+    int active;
+    rel_t *active_next;
+    rel_t **active_prev;
+
+    /* What this connection holds of each kind of memory; see stats.h */
+
+    memacct_t mem;
+
+    /* Counters for rel_stats, only touched by our own thread, and the
+     * latency histograms, from hists_pool once there's a sample if
+     * latency is set */
+
+    struct rel_stats stats;
+    int latency;
+    struct rel_hists *hists;
 };
-rel_t *rel_list;
 
+pool_t rel_pool = POOL_INIT("rel_t", sizeof(rel_t));
+pool_t hists_pool = POOL_INIT("rel_hists", sizeof(struct rel_hists));
+
+/* Each worker thread keeps its own list of connections */
+
+__thread rel_t *rel_list;
+
+/* Connections with unacked packets or undelivered output. Everything
+ * else has nothing for rel_timer to do, so it isn't on this list. */
+
+__thread rel_t *active_list;
+__thread rel_t **active_tail;	/* &active_list when empty, or NULL */
+
+/* Each worker thread schedules its own connections. sched_pass is the
+ * loop_pass that sched_budget belongs to. */
+
+__thread rel_t *sched_head;
+__thread rel_t **sched_tail;	/* &sched_head when empty, or NULL */
+__thread uint64_t sched_pass;
+__thread int sched_budget;
+
+/* Counters of every destroyed connection, which all workers add to.
+ * The counters are the uint64_t's at the start of struct rel_stats. */
+
+static struct rel_stats rel_closed;
+static struct rel_hists rel_closed_hists;
+#define REL_COUNTERS (offsetof(struct rel_stats, start_ns) / sizeof(uint64_t))
+
+
+/* The send queue only holds what we know about each packet, and the
+ * packet itself lives in the payload slab, so sweeping the window
+ * reads a few packed cache lines instead of a new one for every
+ * packet, and a short packet doesn't pin a whole packet_t. */
 
-typedef struct send_bq_element {
-    int sent;
-    struct timespec time_sent;
-    packet_t pkt;
-} send_bq_element_t;
+typedef struct send_meta {
+    packet_t *pkt;		/* from slab_alloc, len bytes */
+    uint64_t time_sent;		/* now_ns when last sent, or 0 */
+    uint16_t len;		/* packet length, in host order */
+    uint8_t sent;
+    uint8_t retransmits;	/* resends (saturating), no RTT sample if any */
+    uint32_t read_us;		/* now_ns / 1000 when read, wrapping */
+} send_meta_t;
+
+/* Packets waiting to be printed, and when they started waiting (in
+ * wrapping microseconds, like read_us) */
+
+typedef struct rec_element {
+    packet_t *pkt;
+    uint32_t held_us;
+} rec_element_t;
+
+/* In file-sink mode payloads go straight to the output file, so the
+ * receive queue only has to remember where each one was written, how
+ * long it was, and whether it had to wait for one before it. */
+
+typedef struct rec_sink_element {
+    long long off;
+    uint16_t len;
+    uint8_t held;
+    uint32_t held_us;
+} rec_sink_element_t;
 
 /* PRIVATE FUNCTIONS:
  *
@@ -70,14 +209,36 @@ typedef struct send_bq_element {
  */
 
 int rel_recv_ack (rel_t *r, int ackno);
-int rel_send_buffered_pkt(rel_t *r, send_bq_element_t* elem);
+int rel_read_input (rel_t *r);
+int rel_send_buffered_pkt(rel_t *r, int seqno);
 void rel_send_ack (rel_t *r, int ackno);
-int rel_read_input_into_packet(rel_t *r, send_bq_element_t *elem);
+int rel_read_input_into_packet(rel_t *r, send_meta_t *m);
+void rel_free_acked (rel_t *r, int ackno, int delivered);
+struct rel_hists *rel_hists_get (rel_t *r);
+int rel_rec_direct (rel_t *r, packet_t *pkt);
+void rel_rec_hold (rel_t *r, packet_t *pkt);
+void rel_rec_release (rel_t *r);
 int rel_check_finished (rel_t *r);
+void rel_advance_unsent (rel_t *r);
 void rel_ack_check_nagle (rel_t *r, int ackno);
-int rel_nagle_constrain_sending_buffered_pkt(rel_t *r, send_bq_element_t* elem);
+int rel_nagle_constrain_sending_buffered_pkt(rel_t *r, packet_t *pkt);
+int rel_sched_constrain (rel_t *r);
+void rel_sched_backlog (rel_t *r);
+void rel_sched_remove (rel_t *r);
+void rel_sched_run (void);
+void rel_send_window (rel_t *r, uint64_t now);
+void rel_rotate (void);
+void rel_activate (rel_t *r);
+void rel_deactivate (rel_t *r);
+int rel_idle (rel_t *r);
+uint64_t rel_pace_interval (rel_t *r, send_meta_t *m);
+int rel_pace_constrain_sending_buffered_pkt(rel_t *r, uint64_t interval);
+void rel_rtt_sample (rel_t *r, int ackno);
 int rel_packet_valid (packet_t *pkt, size_t n);
+uint64_t rel_retransmit_due (rel_t *r, send_meta_t *m);
 int rel_seqno_in_send_window(rel_t *r, int seqno);
+void rel_sink_place (rel_t *r, packet_t *pkt);
+int rel_sink_output (rel_t *r);
 
 /* Creates a new reliable protocol session, returns NULL on failure.
  * Exactly one of c and ss should be NULL.  (ss is NULL when called
@@ -93,18 +254,22 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 
     rel_t *r;
 
-    r = xmalloc (sizeof (*r));
+    r = pool_alloc (&rel_pool);
     memset (r, 0, sizeof (*r));
 
     if (!c) {
         c = conn_create (r, ss);
         if (!c) {
-            free (r);
+            pool_free (&rel_pool, r);
             return NULL;
         }
     }
 
     r->c = c;
+    mem_charge(&r->mem, MEM_CONN, sizeof(rel_t));
+    r->stats.start_ns = now_ns();
+    r->input_mapped = conn_input_mapped(c);
+    r->output_sink = conn_output_seekable(c);
     r->next = rel_list;
     r->prev = &rel_list;
     if (rel_list)
@@ -120,19 +285,27 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
     r->timeout = cc->timeout;
     r->window = cc->window;
     r->single_connection = cc->single_connection;
+    r->pace = cc->pace;
+    r->latency = cc->latency;
 
     /* Create a buffer queue for sending and receiving, starting at
     * index 1 */
 
-    r->send_bq = bq_new(SEND_BUFFER_INITIAL_SIZE, sizeof(send_bq_element_t));
+    r->send_bq = bq_new(SEND_BUFFER_INITIAL_SIZE, sizeof(send_meta_t));
+    bq_account(r->send_bq, &r->mem, MEM_SENDQ);
     bq_increase_head_seq_to(r->send_bq,1);
-    r->rec_bq = bq_new(cc->window, sizeof(packet_t));
-    bq_increase_head_seq_to(r->rec_bq,1);
+    if (r->output_sink) {
+        r->rec_bq = bq_new(cc->window, sizeof(rec_sink_element_t));
+        bq_account(r->rec_bq, &r->mem, MEM_RECVQ);
+        bq_increase_head_seq_to(r->rec_bq,1);
+    }
+    r->sink_off = 0;
 
     /* Send an receive state */
 
     r->seqno = 1;
     r->ackno = 1;
+    r->unsent = 1;
 
     /* Connection teardown state */
 
@@ -158,16 +331,38 @@ rel_destroy (rel_t *r)
     if (r->next)
         r->next->prev = r->prev;
     *r->prev = r->next;
+    if (r->backlogged) rel_sched_remove(r);
+    if (r->active) rel_deactivate(r);
     conn_destroy (r->c);
 
-    /* Free the buffer queues */
+    /* Free the buffer queues, and the packets still in them */
 
+    rel_free_acked(r, r->seqno, 0);
     bq_destroy(r->send_bq);
-    bq_destroy(r->rec_bq);
+    if (r->rec_bq) {
+        if (!r->output_sink) rel_rec_release(r);
+        else bq_destroy(r->rec_bq);
+    }
+
+    /* Keep its counters in the totals */
+
+    uint64_t *from = (uint64_t *)&r->stats, *to = (uint64_t *)&rel_closed;
+    size_t i;
+    for (i = 0; i < REL_COUNTERS; i++) {
+        __atomic_add_fetch(&to[i], from[i], __ATOMIC_RELAXED);
+    }
+    if (r->hists) {
+        hist_add_atomic(&rel_closed_hists.rtt, &r->hists->rtt);
+        hist_add_atomic(&rel_closed_hists.delivery, &r->hists->delivery);
+        hist_add_atomic(&rel_closed_hists.recv_wait, &r->hists->recv_wait);
+        mem_charge(&r->mem, MEM_CONN, -(long)sizeof(struct rel_hists));
+        pool_free(&hists_pool, r->hists);
+    }
 
     /* Free the rel_t block */
 
-    free(r);
+    mem_charge(&r->mem, MEM_CONN, -(long)sizeof(rel_t));
+    pool_free(&rel_pool, r);
 }
 
 /* This function only gets called when the process is running as a
@@ -225,7 +420,15 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
     assert(pkt);
     assert(n >= 0);
 
-    if (!rel_packet_valid(pkt,n)) return;
+    PROBE2(recvpkt, r, n);
+
+    if (!rel_packet_valid(pkt,n)) {
+        if (trace_on()) conn_trace(r->c, TRACE_BAD, pkt, n);
+        r->stats.bad++;
+        return;
+    }
+    r->stats.pkts_recv++;
+    r->stats.bytes_recv += n;
 
     /* Do all the endinannness in one place */
 
@@ -249,7 +452,23 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
      * when we get some space for output. */
 
     if (n > 8) {
-        bq_insert_at(r->rec_bq, pkt->seqno, pkt);
+        if (pkt->seqno < r->ackno) r->stats.dups++;
+
+        if (r->output_sink) {
+            rel_sink_place(r, pkt);
+        }
+        else if (rel_rec_direct(r, pkt)) {
+
+            /* Printed straight away, so ack it, and we might be done */
+
+            rel_send_ack(r, pkt->seqno + 1);
+            rel_check_finished(r);
+            return;
+        }
+        else {
+            rel_rec_hold(r, pkt);
+        }
+        rel_activate(r);
 
         /* Print try to print the output. If this returns
          * 0, it means that no new ack could be sent, so
@@ -257,7 +476,7 @@ rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
          * last one was lost (even though it serves no congestion
          * control purpose in this lab). */
 
-        if (!rel_output(r)) {
+        if (rel_output(r) == REL_OUT_IDLE) {
             rel_send_ack(r, r->ackno);
         }
     }
@@ -273,64 +492,15 @@ rel_read (rel_t *r)
 {
     assert(r);
 
-    /* If we've read an EOF, no reason to even get started */
-
-    if (r->read_eof) return;
-
-    send_bq_element_t elem;
-
-    while (1) {
-
-        /* Check for overrunning send buffer memory */
-
-        if (r->seqno > bq_get_tail_seq(r->send_bq)) {
-
-            /* Double our buffer size, to prevent overflow if we're
-             * reading a really large file in. */
-
-            bq_double_size(r->send_bq);
-        }
-
-        /* Read up to 500 bytes into a packet, overwriting the old
-         * contents of elem */
-
-        int len = rel_read_input_into_packet(r, &elem);
-        if (len == -1) return; /* no more data to read */
-
-        /* If this packet sequence number is within the window,
-         * then send it */
-
-        if (rel_seqno_in_send_window(r,r->seqno)) {
-            rel_send_buffered_pkt(r,&elem);
-        }
-
-        /* Record the packet in the queue, so that we can (re)send it in the 
-         * future. */
-
-        bq_insert_at(r->send_bq, r->seqno, &elem);
-
-        /* Assert that this is the highest seqno element we've inserted */
-        
-        assert(!bq_element_buffered(r->send_bq, r->seqno + 1));
-
-        r->seqno ++;
-
-        /* If we read an EOF, then we should check if we should
-         * close the connection. */
-
-        if (len == 0) {
-            r->read_eof = 1;
-            rel_check_finished(r);
-            return;
-        }
-    }
+    rel_read_input(r);
 }
 
 /* Called whenever there is free buffer space to write output. Handles
  * ack'ing packets after they are written to the terminal, or writing
  * parts of packets when there isn't enough buffer space to fit the whole
- * thing on the terminal. Returns 1 if at least one new ack was sent, 0
- * otherwise.
+ * thing on the terminal. Returns REL_OUT_ACKED if at least one new ack
+ * was sent, REL_OUT_DESTROYED if the connection is finished and gone,
+ * and REL_OUT_IDLE otherwise.
  */
 
 int
@@ -342,30 +512,48 @@ rel_output (rel_t *r)
 
     /* If we've already printed an EOF, then we're done. */
 
-    if (r->printed_eof) return 0;
+    if (r->printed_eof) return REL_OUT_IDLE;
+
+    /* Output files already have the data in place */
+
+    if (r->output_sink) return rel_sink_output(r);
 
     while (1) {
 
         /* Read from the head of the received packets buffer queue,
          * if we have any received packets waiting */
 
+        if (!r->rec_bq) break;
         int rec_seqno = bq_get_head_seq(r->rec_bq);
         if (!bq_element_buffered(r->rec_bq, rec_seqno)) break;
-        packet_t *pkt = bq_get_element(r->rec_bq, rec_seqno);
+        rec_element_t *elem = bq_get_element(r->rec_bq, rec_seqno);
+        packet_t *pkt = elem->pkt;
 
         int bufspace = conn_bufspace(r->c);
 
         /* Print the whole packet, then ack */
 
-        if (bufspace > pkt->len-12) {
+        if (bufspace >= pkt->len-12) {
             conn_output(r->c, pkt->data, pkt->len-12);
+            r->stats.bytes_delivered += pkt->len-12;
+            PROBE3(deliver, r, rec_seqno, pkt->len-12);
+            if (r->latency)
+                hist_record(&rel_hists_get(r)->recv_wait,
+                            (uint32_t)(now_ns() / 1000) - elem->held_us);
             bq_increase_head_seq_to(r->rec_bq, rec_seqno + 1);
 
             sent_ack = pkt->seqno + 1;
+            int eof = (pkt->len == 12);
+
+            /* Nothing else waiting means nothing to keep a queue for */
+
+            mem_charge(&r->mem, MEM_RECVQ, -(long)slab_size(pkt));
+            slab_free(pkt);
+            if (--r->rec_held == 0) rel_rec_release(r);
 
             /* If we just printed out an EOF, update our status */
         
-            if (pkt->len == 12) {
+            if (eof) {
                 r->printed_eof = 1; 
 
                 /* If we just printed an EOF, we should be done. */
@@ -378,10 +566,12 @@ rel_output (rel_t *r)
 
         else if (bufspace > 0) {
             conn_output(r->c, pkt->data, bufspace);
+            r->stats.bytes_delivered += bufspace;
+            PROBE3(deliver, r, rec_seqno, bufspace);
 
             /* Shift the packet data over, removing what we've already printed */
 
-            memcpy(&(pkt->data[0]), &(pkt->data[bufspace]), pkt->len - bufspace);
+            memmove(&(pkt->data[0]), &(pkt->data[bufspace]), pkt->len - 12 - bufspace);
             pkt->len -= bufspace;
             break;
         }
@@ -394,12 +584,94 @@ rel_output (rel_t *r)
     if (sent_ack != 0) rel_send_ack(r, sent_ack);
 
     /* We could have just printed an eof, so just in case,
-     * we should try destroying the rel_t. If we do, we return
-     * 1 to prevent our caller from producing a redundant ack. */
+     * we should try destroying the rel_t. If we do, we say so,
+     * which also keeps our caller from producing a redundant ack. */
+
+    if (rel_check_finished(r)) return REL_OUT_DESTROYED;
+
+    return sent_ack ? REL_OUT_ACKED : REL_OUT_IDLE;
+}
+
+/* Prints a data packet straight from the network, without keeping a
+ * copy, if it's the one we're waiting for, nothing is held up ahead of
+ * it, and there's room for all of it. Returns 1 if it was printed, and
+ * 0 if it has to be held instead. The caller sends the ack.
+ */
+
+int
+rel_rec_direct (rel_t *r, packet_t *pkt)
+{
+    assert(r);
+    assert(pkt);
+
+    if (r->rec_held || r->printed_eof || pkt->seqno != r->ackno) return 0;
+
+    int bufspace = conn_bufspace(r->c);
+    if (bufspace < pkt->len - 12) return 0;
+
+    conn_output(r->c, pkt->data, pkt->len - 12);
+    r->stats.bytes_delivered += pkt->len - 12;
+    PROBE3(deliver, r, pkt->seqno, pkt->len - 12);
+    if (pkt->len == 12) r->printed_eof = 1;
+
+    return 1;
+}
+
+/* Keeps a copy of a data packet that can't be printed yet, in the
+ * payload slab, creating the receive queue if nothing was held until
+ * now. Anything outside the receive window, or already held, is
+ * dropped.
+ */
 
-    if (rel_check_finished(r)) return 1;
+void
+rel_rec_hold (rel_t *r, packet_t *pkt)
+{
+    assert(r);
+    assert(pkt);
 
-    return sent_ack;
+    if (pkt->seqno < r->ackno || pkt->seqno >= r->ackno + r->window) return;
+
+    if (!r->rec_bq) {
+        r->rec_bq = bq_new(r->window, sizeof(rec_element_t));
+        bq_account(r->rec_bq, &r->mem, MEM_RECVQ);
+        bq_increase_head_seq_to(r->rec_bq, r->ackno);
+    }
+
+    if (bq_element_buffered(r->rec_bq, pkt->seqno)) {
+        r->stats.dups++;
+        return;
+    }
+
+    rec_element_t elem;
+    elem.pkt = slab_alloc(pkt->len);
+    elem.held_us = now_ns() / 1000;
+    mem_charge(&r->mem, MEM_RECVQ, slab_size(elem.pkt));
+    memcpy(elem.pkt, pkt, pkt->len);
+    bq_insert_at(r->rec_bq, pkt->seqno, &elem);
+    r->rec_held++;
+}
+
+/* Frees the receive queue, along with any packets still in it.
+ */
+
+void
+rel_rec_release (rel_t *r)
+{
+    assert(r);
+    assert(r->rec_bq);
+
+    int i;
+    for (i = bq_get_head_seq(r->rec_bq); i <= bq_get_tail_seq(r->rec_bq); i++) {
+        if (bq_element_buffered(r->rec_bq, i)) {
+            packet_t *pkt = ((rec_element_t *)bq_get_element(r->rec_bq, i))->pkt;
+            mem_charge(&r->mem, MEM_RECVQ, -(long)slab_size(pkt));
+            slab_free(pkt);
+        }
+    }
+
+    bq_destroy(r->rec_bq);
+    r->rec_bq = NULL;
+    r->rec_held = 0;
 }
 
 /* Called periodically. Checks every outstanding packet that hasn't yet been ack'd,
@@ -410,38 +682,99 @@ rel_output (rel_t *r)
 void
 rel_timer ()
 {
+    uint64_t now = now_ns();
 
-    /* Iterate over all the reliable connections */
+    /* Connections that ran out of turns go first */
 
-    rel_t *r;
-    for (r = rel_list; r != NULL; r = r->next) {
+    rel_sched_run();
+
+    /* Iterate over the connections that have anything going on */
+
+    rel_t *r, *next;
+    for (r = active_list; r != NULL; r = next) {
+        next = r->active_next;
 
         /* Poke the output, just in case it died on us */
 
-        rel_output(r);
-    
-        /* Send window is [head of buffer queue, head of buffer queue + window size],
-         * so we iterate over the send window, and send anything that's timed out. */
+        if (rel_output(r) == REL_OUT_DESTROYED) continue;
+
+        rel_send_window(r, now);
 
-        int i = 0;
-        for (i = bq_get_head_seq(r->send_bq); rel_seqno_in_send_window(r,i); i++) {
+        if (rel_idle(r)) rel_deactivate(r);
+    }
 
-            /* This is just a safety check, in case we haven't read in this part
-             * of the send window yet */
+    /* Start with someone else next time */
 
-            if (!bq_element_buffered(r->send_bq, i)) continue;
+    rel_rotate();
+}
 
-            /* Borrowed need_timer_in from rlib: just checks whether it's
-             * been r->timeout ms since elem->time_sent */
+/* Fills in st with the connection's counters and current state, for
+ * the control socket.
+ */
 
-            send_bq_element_t *elem = bq_get_element(r->send_bq, i);
-            if (need_timer_in (&(elem->time_sent), r->timeout) == 0) {
-                rel_send_buffered_pkt(r,elem);
-            }
-        }
+void
+rel_stats (rel_t *r, struct rel_stats *st)
+{
+    assert(r);
+    assert(st);
+
+    *st = r->stats;
+    st->window = r->window;
+    st->rto_ms = r->timeout;
+    st->srtt_ns = r->srtt;
+
+    int head_seq = bq_get_head_seq(r->send_bq);
+    st->send_queued = r->seqno - head_seq;
+    st->in_flight = r->unsent - head_seq;
+
+    st->recv_queued = r->rec_held;
+}
+
+/* Adds up what destroyed connections counted.
+ */
+
+void
+rel_stats_closed (struct rel_stats *st)
+{
+    assert(st);
+
+    uint64_t *from = (uint64_t *)&rel_closed, *to = (uint64_t *)st;
+    size_t i;
+    for (i = 0; i < REL_COUNTERS; i++) {
+        to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
     }
 }
 
+/* Adds the connection's latency histograms to h, for the control
+ * socket.
+ */
+
+void
+rel_hists (rel_t *r, struct rel_hists *h)
+{
+    assert(r);
+    assert(h);
+
+    if (!r->hists) return;
+
+    hist_add(&h->rtt, &r->hists->rtt);
+    hist_add(&h->delivery, &r->hists->delivery);
+    hist_add(&h->recv_wait, &r->hists->recv_wait);
+}
+
+/* Adds up the histograms of destroyed connections.
+ */
+
+void
+rel_hists_closed (struct rel_hists *h)
+{
+    assert(h);
+
+    hist_add_loaded(&h->rtt, &rel_closed_hists.rtt);
+    hist_add_loaded(&h->delivery, &rel_closed_hists.delivery);
+    hist_add_loaded(&h->recv_wait, &rel_closed_hists.recv_wait);
+}
+
 /***********************************
  * Helper function implementations *
  ***********************************/
@@ -470,8 +803,15 @@ rel_recv_ack (rel_t *r, int ackno)
         return 0;
     }
 
+    PROBE3(ack_advance, r, bq_get_head_seq(r->send_bq), ackno);
+
+    /* Time the packet this ack is for, before it leaves the queue */
+
+    rel_rtt_sample(r, ackno);
+
     /* Move the head of the window to the ackno */
 
+    rel_free_acked(r, ackno, 1);
     bq_increase_head_seq_to(r->send_bq, ackno);
 
     /* Assert that moving the head didn't mess with our buffered
@@ -495,60 +835,210 @@ rel_recv_ack (rel_t *r, int ackno)
         return 1;
     }
 
-    /* Send any buffered packets that are newly within the window */
+    /* Send any buffered packets that are newly within the window.
+     * Nothing below r->unsent needs looking at. */
+
+    rel_advance_unsent(r);
 
     int i;
-    for (i = ackno; i < ackno + r->window; i++) {
+    for (i = r->unsent; i < ackno + r->window && i < r->seqno; i++) {
+
+        /* Send out the packet, if noone has sent it yet. */
+
+        send_meta_t *m = bq_get_element(r->send_bq, i);
+        if (!m->sent) {
+            rel_send_buffered_pkt(r, i);
+        }
+    }
+
+    /* Mapped input is only read as far as the window, so pull in
+     * whatever the window has room for now. */
+
+    if (r->input_mapped) return rel_read_input(r);
+
+    return 0;
+}
+
+/* Does the work for rel_read: reads input into packets until there is
+ * no more available, sending what fits in the window.
+ *
+ * Returns 1 if reading an EOF closed the connection, 0 if not.
+ */
+
+int
+rel_read_input (rel_t *r)
+{
+    assert(r);
+
+    /* If we've read an EOF, no reason to even get started */
+
+    if (r->read_eof) return 0;
+
+    send_meta_t m;
+
+    while (1) {
+
+        /* A mapped file can always be read later, so don't pull in
+         * more than we are allowed to send. rel_recv_ack calls us
+         * again as the window opens. */
+
+        if (r->input_mapped && !rel_seqno_in_send_window(r, r->seqno)) return 0;
+
+        /* Check for overrunning send buffer memory */
+
+        if (r->seqno > bq_get_tail_seq(r->send_bq)) {
+
+            /* Double our buffer size, to prevent overflow if we're
+             * reading a really large file in. */
+
+            bq_double_size(r->send_bq);
+        }
+
+        /* Read up to 500 bytes into a packet, overwriting the old
+         * contents of m and pkt */
+
+        int len = rel_read_input_into_packet(r, &m);
+        if (len == -1) return 0; /* no more data to read */
+
+        /* Record the packet in the queue, so that we can (re)send it in the 
+         * future. */
+
+        bq_insert_at(r->send_bq, r->seqno, &m);
+        rel_activate(r);
+
+        /* Assert that this is the highest seqno element we've inserted */
+        
+        assert(!bq_element_buffered(r->send_bq, r->seqno + 1));
+
+        int seqno = r->seqno ++;
+
+        /* If this packet sequence number is within the window,
+         * then send it */
 
-        /* If we reach a point we haven't buffered in, we're done. */
+        if (rel_seqno_in_send_window(r,seqno)) {
+            rel_send_buffered_pkt(r,seqno);
+        }
 
-        if (!bq_element_buffered(r->send_bq, i)) return 0;
+        /* If we read an EOF, then we should check if we should
+         * close the connection. */
 
-        /* Otherwise send out the packet, if noone has sent it yet. */
+        if (len == 0) {
+            r->read_eof = 1;
+            return rel_check_finished(r);
+        }
+    }
+}
+
+/* Send window is [head of buffer queue, head of buffer queue + window
+ * size], so we iterate over the send window, and send anything that's
+ * timed out or hasn't been sent yet. Everything from the head up to
+ * the last packet we read is buffered, so we walk the metadata a run
+ * at a time rather than looking each one up.
+ */
+
+void
+rel_send_window (rel_t *r, uint64_t now)
+{
+    assert(r);
 
-        send_bq_element_t *elem = bq_get_element(r->send_bq, i);
-        if (!elem->sent) {
-            rel_send_buffered_pkt(r, elem);
+    int i = bq_get_head_seq(r->send_bq);
+    int end = i + r->window;
+    uint64_t next = UINT64_MAX;
+
+    if (end > r->seqno) end = r->seqno;
+
+    while (i < end) {
+        int n;
+        send_meta_t *m = bq_get_run(r->send_bq, i, &n);
+        if (n > end - i) n = end - i;
+
+        for (; n > 0; n--, i++, m++) {
+
+            /* Resend if it's been r->timeout ms since m->time_sent,
+             * otherwise make sure we get called back when it has */
+
+            uint64_t due = rel_retransmit_due(r, m);
+            if (due > now) {
+                if (m->sent && due < next) next = due;
+                continue;
+            }
+
+            rel_send_buffered_pkt(r,i);
+
+            /* Out of turns: the round robin will pick up from here */
+
+            if (r->backlogged) goto out;
         }
     }
 
-    return 0;
+ out:
+    if (next != UINT64_MAX) request_timer_at(next);
 }
 
-/* Sends a buffered packet, and handles updating the meta data
- * associated with the packet. Will also put in the latest ackno
+/* Sends the buffered packet seqno, and handles updating the meta
+ * data associated with the packet. Will also put in the latest ackno
  * as a piggyback for the packet, and recalculate the cksum.
  */
 
 int 
-rel_send_buffered_pkt(rel_t *r, send_bq_element_t* elem) 
+rel_send_buffered_pkt(rel_t *r, int seqno) 
 {
     assert(r);
-    assert(elem);
-    assert(ntohl(elem->pkt.seqno) < bq_get_head_seq(r->send_bq) + r->window);
-    assert(ntohl(elem->pkt.seqno) > 0);
+    assert(seqno < bq_get_head_seq(r->send_bq) + r->window);
+    assert(seqno > 0);
+    assert(bq_element_buffered(r->send_bq, seqno));
+
+    send_meta_t *m = bq_get_element(r->send_bq, seqno);
+    packet_t *pkt = m->pkt;
 
     /* If this is a small packet, check Nagle conditions */
 
-    if (rel_nagle_constrain_sending_buffered_pkt(r, elem)) return 0;
+    if (rel_nagle_constrain_sending_buffered_pkt(r, pkt)) return 0;
+
+    /* If we're out of turns, pacing and it's too early, or over our
+     * rate limit, rel_timer will get it later */
+
+    if (rel_sched_constrain(r)) return 0;
+    uint64_t interval = rel_pace_interval(r, m);
+    if (rel_pace_constrain_sending_buffered_pkt(r, interval)) return 0;
+    if (conn_send_wait(r->c, m->len)) return 0;
+    r->pace_next += interval;
+    r->deficit--;
+    sched_budget--;
 
     /* Update records associated with the packet */
 
-    elem->sent = 1;
-    clock_gettime (CLOCK_MONOTONIC, &elem->time_sent);
+    int event = m->sent ? TRACE_RETX : TRACE_SEND;
+    if (m->sent) {
+        r->stats.retransmits++;
+        if (m->retransmits < UINT8_MAX) m->retransmits++;
+        PROBE3(retransmit, r, seqno, m->retransmits);
+    } else {
+        PROBE3(send, r, seqno, m->len);
+    }
+    m->sent = 1;
+    m->time_sent = now_ns();
+    rel_advance_unsent(r);
+
+    /* Have rel_timer run right when this one needs resending */
+
+    request_timer_at(rel_retransmit_due(r, m));
 
     /* Update to the current ack number */
 
-    elem->pkt.ackno = htonl(r->ackno);
+    pkt->ackno = htonl(r->ackno);
 
     /* Recalculate the checksum, cause we changed the ackno */
 
-    elem->pkt.cksum = 0;
-    elem->pkt.cksum = cksum(&elem->pkt, ntohs(elem->pkt.len));
+    pkt->cksum = 0;
+    pkt->cksum = cksum(pkt, m->len);
 
     /* Do the dirty deed */
 
-    conn_sendpkt(r->c, &(elem->pkt), ntohs(elem->pkt.len));
+    if (trace_on()) conn_trace(r->c, event, pkt, m->len);
+    conn_sendpkt(r->c, pkt, m->len);
+    r->stats.pkts_sent++;
+    r->stats.bytes_sent += m->len;
 
     return 1;
 }
@@ -576,42 +1066,61 @@ rel_send_ack (rel_t *r, int ackno)
 
     /* Send it off */
 
+    if (trace_on()) conn_trace(r->c, TRACE_ACK, &ack_packet, 8);
     conn_sendpkt (r->c, &ack_packet, 8);
+    r->stats.acks_sent++;
 }
 
-/* Reads up to 500 bytes of data from conn_input() into the
- * packet passed in, writing everything in network byte order,
- * and sets metadata so that the packet will be sent at the
- * next available opportunity.
+/* Reads up to 500 bytes of data from conn_input() into a new
+ * packet, writing everything in network byte order, and sets
+ * metadata so that the packet will be sent at the next available
+ * opportunity. The packet is read into a full-size slab object, and
+ * only moved to a smaller size class if it came up short.
  */
 
 int
-rel_read_input_into_packet(rel_t *r, send_bq_element_t *elem)
+rel_read_input_into_packet(rel_t *r, send_meta_t *m)
 {
     assert(r);
-    assert(elem);
+    assert(m);
+
+    packet_t *pkt = slab_alloc(sizeof(packet_t));
 
     /* Read data directly into our packet */
 
-    int len = conn_input(r->c, &(elem->pkt.data[0]), 500);
-    if (len == 0) return -1; /* no more data to read */
+    int len = conn_input(r->c, &(pkt->data[0]), 500);
+    if (len == 0) { /* no more data to read */
+        slab_free(pkt);
+        return -1;
+    }
     if (len == -1) {
         len = 0; /* send an EOF */
     }
 
+    if (12 + len <= slab_size(pkt) / 2) {
+        packet_t *small = slab_alloc(12 + len);
+        memcpy(small->data, pkt->data, len);
+        slab_free(pkt);
+        pkt = small;
+    }
+    mem_charge(&r->mem, MEM_SENDQ, slab_size(pkt));
+    m->pkt = pkt;
+
     /* Build packet frame data */
 
-    elem->pkt.ackno = htonl(r->ackno);
-    elem->pkt.seqno = htonl(r->seqno);
-    elem->pkt.len = htons(12 + len);
-    elem->pkt.cksum = 0;
-    elem->pkt.cksum = cksum(&elem->pkt, 12 + len);
+    pkt->ackno = htonl(r->ackno);
+    pkt->seqno = htonl(r->seqno);
+    pkt->len = htons(12 + len);
+    pkt->cksum = 0;
+    pkt->cksum = cksum(pkt, 12 + len);
 
     /* Time sent is 1970, so when there's free window, it'll be sent */
 
-    elem->time_sent.tv_sec = 0;
-    elem->time_sent.tv_nsec = 0;
-    elem->sent = 0;
+    m->time_sent = 0;
+    m->read_us = now_ns() / 1000;
+    m->len = 12 + len;
+    m->sent = 0;
+    m->retransmits = 0;
 
     return len;
 }
@@ -639,31 +1148,78 @@ rel_check_finished (rel_t *r)
         return 0;
     }
 
-    /* Send window is [head of buffer queue, head of buffer queue + window size],
-     * so we iterate over the send window, and check if there's anything in it that
-     * we've sent (cause that would mean we haven't gotten an ack for that yet). */
+    /* The send queue head is the lowest un-ack'd seqno, and the queue
+     * holds everything from there up to the last packet we read, so
+     * if the head hasn't caught up with seqno, something's un-ack'd. */
 
-    int i = 0;
-    for (i = bq_get_head_seq(r->send_bq); i <= bq_get_tail_seq(r->send_bq); i++) {
+    if (bq_get_head_seq(r->send_bq) < r->seqno) return 0;
 
-        /* If the element isn't buffered, we definately haven't sent it */
+    /* If we reach here, then we've received all acks for packets we sent, and
+     * both other conditions are met. Destroy this rel_t. */
+
+    rel_destroy(r);
+
+    return 1;
+}
 
+/* Frees the packets below ackno, which are about to leave the send
+ * queue, timing their delivery if that's why. Only looks at what's
+ * newly ack'd.
+ */
+
+void
+rel_free_acked (rel_t *r, int ackno, int delivered)
+{
+    assert(r);
+
+    uint32_t now_us = now_ns() / 1000;
+
+    int i;
+    for (i = bq_get_head_seq(r->send_bq); i < ackno; i++) {
         if (!bq_element_buffered(r->send_bq, i)) continue;
 
-        /* Otherwise, we check the sent flag */
+        send_meta_t *m = bq_get_element(r->send_bq, i);
+        if (delivered && r->latency)
+            hist_record(&rel_hists_get(r)->delivery, now_us - m->read_us);
+        mem_charge(&r->mem, MEM_SENDQ, -(long)slab_size(m->pkt));
+        slab_free(m->pkt);
+    }
+}
 
-        send_bq_element_t *elem = bq_get_element(r->send_bq, i);
-        if (!elem->sent) {
-            return 0;
-        }
+/* Returns the connection's latency histograms, making them on the
+ * first sample, so connections that never get one don't pay for them.
+ */
+
+struct rel_hists *
+rel_hists_get (rel_t *r)
+{
+    assert(r);
+
+    if (!r->hists) {
+        r->hists = pool_alloc(&hists_pool);
+        memset(r->hists, 0, sizeof(*r->hists));
+        mem_charge(&r->mem, MEM_CONN, sizeof(*r->hists));
     }
+    return r->hists;
+}
 
-    /* If we reach here, then we've received all acks for packets we sent, and
-     * both other conditions are met. Destroy this rel_t. */
+/* Moves r->unsent past every packet that has now been sent at least
+ * once. Packets mostly go out in order, so this is usually one step.
+ */
 
-    rel_destroy(r);
+void
+rel_advance_unsent (rel_t *r)
+{
+    assert(r);
 
-    return 1;
+    if (r->unsent < bq_get_head_seq(r->send_bq))
+        r->unsent = bq_get_head_seq(r->send_bq);
+
+    while (r->unsent < r->seqno) {
+        send_meta_t *m = bq_get_element(r->send_bq, r->unsent);
+        if (!m->sent) break;
+        r->unsent++;
+    }
 }
 
 /* This function gets called every ack to update the Nagle 
@@ -694,23 +1250,24 @@ rel_ack_check_nagle (rel_t *r, int ackno)
  */
 
 int
-rel_nagle_constrain_sending_buffered_pkt(rel_t *r, send_bq_element_t* elem)
+rel_nagle_constrain_sending_buffered_pkt(rel_t *r, packet_t *pkt)
 {
     assert(r);
-    assert(elem);
+    assert(pkt);
 
-    if (ntohs(elem->pkt.len) < 512) {
+    if (ntohs(pkt->len) < 512) {
 
         /* If there's another small packet unacknowledged, don't send this one. */
 
-        if (r->nagle_outstanding != 0 && r->nagle_outstanding != ntohl(elem->pkt.seqno)) {
+        if (r->nagle_outstanding != 0 && r->nagle_outstanding != ntohl(pkt->seqno)) {
+            PROBE2(nagle_defer, r, ntohl(pkt->seqno));
             return 1;
         }
 
         /* Otherwise record that this our small packet oustanding, but still send it */
 
         else {
-            r->nagle_outstanding = ntohl(elem->pkt.seqno);
+            r->nagle_outstanding = ntohl(pkt->seqno);
             return 0;
         }
     }
@@ -720,6 +1277,244 @@ rel_nagle_constrain_sending_buffered_pkt(rel_t *r, send_bq_element_t* elem)
     return 0;
 }
 
+/* This function is called on every packet send. A connection that
+ * isn't in the backlog gets a fresh quantum the first time it sends in
+ * each pass of the event loop. Returns 1 if the connection has used up
+ * its quantum or the pass has used up its budget, in which case the
+ * connection joins the backlog, and 0 otherwise. Nothing is charged
+ * here, since pacing or rate limits may still hold the packet back.
+ */
+
+int
+rel_sched_constrain (rel_t *r)
+{
+    assert(r);
+
+    uint64_t pass = loop_pass();
+
+    if (sched_pass != pass) {
+        sched_pass = pass;
+        sched_budget = SCHED_BUDGET;
+    }
+
+    if (!r->backlogged && r->grant_pass != pass) {
+        r->grant_pass = pass;
+        r->deficit = SCHED_QUANTUM;
+    }
+
+    if (r->deficit > 0 && sched_budget > 0) return 0;
+
+    rel_sched_backlog(r);
+    return 1;
+}
+
+/* Puts a connection at the tail of the backlog, and has rel_timer run
+ * again as soon as possible to serve it.
+ */
+
+void
+rel_sched_backlog (rel_t *r)
+{
+    assert(r);
+
+    request_timer_at(now_ns());
+    if (r->backlogged) return;
+
+    if (!sched_tail) sched_tail = &sched_head;
+    r->backlogged = 1;
+    r->sched_next = NULL;
+    r->sched_prev = sched_tail;
+    *sched_tail = r;
+    sched_tail = &r->sched_next;
+}
+
+void
+rel_sched_remove (rel_t *r)
+{
+    assert(r);
+    assert(r->backlogged);
+
+    if (r->sched_next)
+        r->sched_next->sched_prev = r->sched_prev;
+    else
+        sched_tail = r->sched_prev;
+    *r->sched_prev = r->sched_next;
+    r->backlogged = 0;
+}
+
+/* Serves the backlog in deficit round robin order until it is empty or
+ * this pass's budget is spent. Each connection taken off the head gets
+ * another quantum and sends what it can; if it runs out again it goes
+ * back on the tail, otherwise its leftover deficit is dropped.
+ */
+
+void
+rel_sched_run (void)
+{
+    uint64_t now = now_ns(), pass = loop_pass();
+
+    while (sched_head) {
+        if (sched_pass != pass) {
+            sched_pass = pass;
+            sched_budget = SCHED_BUDGET;
+        }
+        if (sched_budget <= 0) {
+            request_timer_at(now);
+            return;
+        }
+
+        rel_t *r = sched_head;
+        rel_sched_remove(r);
+        r->deficit += SCHED_QUANTUM;
+        rel_send_window(r, now);
+        if (!r->backlogged) r->deficit = 0;
+    }
+}
+
+/* Moves the head of active_list to the tail, so rel_timer's sweep
+ * starts at a different connection every time.
+ */
+
+void
+rel_rotate (void)
+{
+    rel_t *head = active_list;
+
+    if (!head || !head->active_next) return;
+
+    active_list = head->active_next;
+    active_list->active_prev = &active_list;
+    head->active_next = NULL;
+    head->active_prev = active_tail;
+    *active_tail = head;
+    active_tail = &head->active_next;
+}
+
+/* Puts a connection on the active list, if it isn't already. Called
+ * whenever a packet is queued for sending or for output.
+ */
+
+void
+rel_activate (rel_t *r)
+{
+    assert(r);
+
+    if (r->active) return;
+
+    r->active = 1;
+    r->active_next = active_list;
+    r->active_prev = &active_list;
+    if (active_list)
+        active_list->active_prev = &r->active_next;
+    else
+        active_tail = &r->active_next;
+    active_list = r;
+}
+
+void
+rel_deactivate (rel_t *r)
+{
+    assert(r);
+    assert(r->active);
+
+    if (r->active_next)
+        r->active_next->active_prev = r->active_prev;
+    else
+        active_tail = r->active_prev;
+    *r->active_prev = r->active_next;
+    r->active = 0;
+}
+
+/* Returns 1 if everything we've read has been ack'd, nothing received
+ * is waiting for output, and we're not waiting for a turn to send, so
+ * rel_timer has nothing to do for this connection.
+ */
+
+int
+rel_idle (rel_t *r)
+{
+    assert(r);
+
+    return (bq_get_head_seq(r->send_bq) == r->seqno
+            && !(r->rec_bq
+                 && bq_element_buffered(r->rec_bq, bq_get_head_seq(r->rec_bq)))
+            && !r->backlogged);
+}
+
+/* When pacing, each data packet takes up len / rate seconds of the
+ * link, where the rate is either configured or one window per
+ * smoothed RTT (times 5/4, so the window rather than the pacer stays
+ * the real limit). Returns that time in ns, or 0 if not pacing.
+ */
+
+uint64_t
+rel_pace_interval (rel_t *r, send_meta_t *m)
+{
+    assert(r);
+    assert(m);
+
+    uint64_t len = m->len;
+
+    if (r->pace > 0) {
+        return len * 1000000000 / r->pace;
+    }
+    if (r->pace < 0 && r->srtt) {
+        return r->srtt * len * 4 / (5 * (uint64_t) r->window * 512);
+    }
+    return 0;
+}
+
+/* This function is called on every packet send, after the Nagle
+ * check. pace_next advances by the pacing interval for every packet
+ * sent, but is never allowed to fall more than PACE_BURST packets
+ * behind the clock, so an idle connection can't save up a big burst.
+ * Returns 1 if the packet has to wait, after asking for rel_timer to
+ * run once PACE_BURST packets can go together, and 0 otherwise.
+ */
+
+int
+rel_pace_constrain_sending_buffered_pkt(rel_t *r, uint64_t interval)
+{
+    assert(r);
+
+    if (!interval) return 0;
+
+    uint64_t now = now_ns();
+    uint64_t slack = PACE_BURST * interval;
+
+    if (r->pace_next + slack < now) {
+        r->pace_next = now - slack;
+    }
+
+    if (r->pace_next > now) {
+        request_timer_at(r->pace_next + (PACE_BURST - 1) * interval);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Updates the smoothed RTT from the packet just below ackno, as long
+ * as it is newly ack'd and was only sent once (Karn's rule: an ack
+ * for a retransmitted packet can't tell us which copy arrived).
+ */
+
+void
+rel_rtt_sample (rel_t *r, int ackno)
+{
+    assert(r);
+
+    if (ackno <= bq_get_head_seq(r->send_bq)) return;
+    if (!bq_element_buffered(r->send_bq, ackno - 1)) return;
+
+    send_meta_t *m = bq_get_element(r->send_bq, ackno - 1);
+    if (!m->sent || m->retransmits) return;
+
+    uint64_t rtt = now_ns() - m->time_sent;
+    r->srtt = r->srtt ? (7 * r->srtt + rtt) / 8 : rtt;
+    if (r->latency) hist_record(&rel_hists_get(r)->rtt, rtt / 1000);
+}
+
 /* Checks whether a packet has been corrupted, either by cksum or 
  * because the length is shorter than advertised. Returns 1 if packet 
  * is ok, and 0 otherwise.
@@ -758,3 +1553,115 @@ rel_seqno_in_send_window(rel_t *r, int seqno)
     int head_seq = bq_get_head_seq(r->send_bq);
     return (seqno >= head_seq) && (seqno < head_seq + r->window);
 }
+
+/* File-sink mode: writes the payload of a newly arrived packet straight
+ * into the output file. The head of the queue goes right at sink_off.
+ * We can't know the sizes of packets we haven't received yet, so
+ * anything after it goes in a full-size slot, which is right for
+ * everything but a short tail in a bulk transfer, and we record where.
+ * Slots are counted from an origin that only moves up to the head
+ * while nothing is queued, so they never overlap, and a packet's slot
+ * is never below where it really belongs: if the guess was wrong,
+ * rel_sink_output moves just that packet down once it's the head.
+ * Nothing is queued, and so nothing is acked, unless the write worked.
+ */
+
+void
+rel_sink_place (rel_t *r, packet_t *pkt)
+{
+    assert(r);
+    assert(pkt);
+    assert(r->output_sink);
+
+    /* Duplicates are already written */
+
+    if (bq_element_buffered(r->rec_bq, pkt->seqno)) {
+        r->stats.dups++;
+        return;
+    }
+
+    int head_seq = bq_get_head_seq(r->rec_bq);
+    if (pkt->seqno < head_seq || pkt->seqno >= head_seq + r->window) return;
+
+    if (!r->rec_held) {
+        r->sink_org_seq = head_seq;
+        r->sink_org_off = r->sink_off;
+    }
+
+    rec_sink_element_t elem;
+    elem.off = pkt->seqno == head_seq ? r->sink_off
+        : r->sink_org_off + (long long)(pkt->seqno - r->sink_org_seq) * 500;
+    elem.len = pkt->len - 12;
+    elem.held = pkt->seqno != head_seq;
+    elem.held_us = now_ns() / 1000;
+    if (elem.len && conn_output_at(r->c, elem.off, pkt->data, elem.len) < 0)
+        return;
+    bq_insert_at(r->rec_bq, pkt->seqno, &elem);
+    r->rec_held++;
+}
+
+/* File-sink version of rel_output. The payloads are already in the
+ * file, so delivering a packet just means moving it down if a short
+ * packet before it left it too far along, committing it, and moving
+ * the head of the queue on. Returns the same as rel_output.
+ */
+
+int
+rel_sink_output (rel_t *r)
+{
+    assert(r);
+    assert(r->output_sink);
+
+    int sent_ack = 0;
+
+    while (1) {
+        int rec_seqno = bq_get_head_seq(r->rec_bq);
+        if (!bq_element_buffered(r->rec_bq, rec_seqno)) break;
+        rec_sink_element_t *elem = bq_get_element(r->rec_bq, rec_seqno);
+        int len = elem->len;
+
+        /* If the move fails, it stays unacked, and the connection dies
+         * of the write error */
+
+        if (len && elem->off != r->sink_off
+            && conn_output_move(r->c, elem->off, r->sink_off, len) < 0)
+            break;
+        if (elem->held && r->latency) {
+            hist_record(&rel_hists_get(r)->recv_wait,
+                        (uint32_t)(now_ns() / 1000) - elem->held_us);
+        }
+
+        bq_increase_head_seq_to(r->rec_bq, rec_seqno + 1);
+        r->rec_held--;
+        sent_ack = rec_seqno + 1;
+
+        /* An EOF cuts the file to what we've committed */
+
+        if (len == 0) {
+            conn_output(r->c, NULL, 0);
+            r->printed_eof = 1;
+            break;
+        }
+
+        r->sink_off += len;
+        r->stats.bytes_delivered += len;
+        PROBE3(deliver, r, rec_seqno, len);
+        conn_output_commit(r->c, r->sink_off);
+    }
+
+    if (sent_ack != 0) rel_send_ack(r, sent_ack);
+
+    if (rel_check_finished(r)) return REL_OUT_DESTROYED;
+
+    return sent_ack ? REL_OUT_ACKED : REL_OUT_IDLE;
+}
+
+/* Returns the time at which m's packet should be resent if it hasn't been
+ * ack'd by then: r->timeout ms after it was last sent.
+ */
+
+uint64_t
+rel_retransmit_due (rel_t *r, send_meta_t *m)
+{
+    return m->time_sent + r->timeout * 1000000ULL;
+}
@@ -12,25 +12,64 @@
 #include <getopt.h>
 #include <assert.h>
 #include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include "rlib.h"
+#include "bq.h"
+#include "uring.h"
+#include "pool.h"
+#include "logger.h"
+#include "impair.h"
 
 char *progname;
 int opt_debug;
-
-int opt_drop = 0;
-int opt_corrupt = 0;
-int opt_delay = 0;
-int opt_duplicate = 0;
-
-int log_in = -1;
-int log_out = -1;
+/* Our pid, for --debug output.  Like opt_debug, it is set while
+ * parsing options and only read once the workers have started. */
+static int debug_pid;
+
+/* Impairments applied to every packet sent (-r, -I and so on), and
+ * the number of workers that have made a stage for them */
+static impair_conf_t impair_conf;
+static int impair_streams;
+
+/* -l traffic logs, or NULL.  Uses of them hold log_lock for reading,
+ * so that log_close can take them away at exit even though workers
+ * and the control thread may still be running */
+static logger_t *log_in;
+static logger_t *log_out;
+static pthread_rwlock_t log_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int opt_log_drop;	/* drop log data rather than wait for disk */
+
+static int opt_pipeline = 0;
+static int opt_uring = 0;
+static char *opt_control;	/* control socket path (-C), or NULL */
+static char *opt_stats;		/* where to write statistics at the end
+				   of a single connection (-S), or NULL */
+
+static uint64_t started_ns;	/* now_ns when the control socket opened
+				   (or at startup, with -S) */
+
+/* Rate limits in bytes per second, 0 for none.  They may change while
+ * we run (see read_rate_file), so they are accessed atomically, and
+ * rate_generation counts the changes. */
+static uint64_t opt_conn_rate = 0;
+static uint64_t opt_global_rate = 0;
+static char *opt_rate_file;
+static int rate_generation;
+static volatile sig_atomic_t rate_reload;
+static volatile sig_atomic_t stats_request;	/* SIGUSR1 seen */
+static int rate_shares = 1;	/* workers splitting opt_global_rate */
 
 struct config_client {
   struct config_common c;
@@ -41,22 +80,101 @@ struct config_client {
 struct config_server {
   struct config_common c;
   int udp_socket;		/* Receive all UDP over this socket */
+  int nworkers;			/* Threads, each with its own udp_socket */
+  struct sockaddr_storage local; /* Address the udp_sockets are bound to */
   struct sockaddr_storage dest;	/* Demultiplex traffic and relay it to
 				   individual TCP connections to this
 				   address */
 };
 
-static struct config_server *serverconf;
-
 static void conn_mkevents (void);
+static int conn_uring_send (conn_t *c, const packet_t *pkt, size_t len);
+static void conn_uring_read (conn_t *c);
+static void conn_uring_write (conn_t *c);
 static int debug_recv (int s, packet_t *buf, size_t len, int flags,
 		       struct sockaddr_storage *from);
 
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
+
+/* Packet events the -T trace ring holds */
+#define TRACE_ENTRIES 65536
+
+/* Input is read from rfd in blocks of this many bytes and handed out
+ * to conn_input from the buffer, so a bulk stream costs one read per
+ * block rather than one per packet. */
+#define INBUF_SIZE 65536
+
+/* When input is a memory-mapped file, pages are prefetched this far
+ * ahead of conn_input and dropped again once they are this far
+ * behind, so resident memory stays constant for any file size. */
+#define INMAP_WINDOW (1024 * 1024)
+
+/* In pipelined mode, a separate io thread reads rfd into IOCHUNK_IN
+ * sized chunks and writes wfd from IOCHUNK_OUT sized chunks, handing
+ * them to and from the event loop through concurrent buffer queues. */
+#define IOCHUNK_IN 16384
+#define IOCHUNK_OUT 1024
+#define IOQ_IN 8
+#define IOQ_OUT 32
+
+struct iochunk_in {
+  int len;			/* -1 for EOF or error */
+  char data[IOCHUNK_IN];
+};
+
+struct iochunk_out {
+  int len;			/* 0 for EOF */
+  char data[IOCHUNK_OUT];
+};
+
+/* With the io_uring backend, each worker owns one ring and an arena
+ * of UR_SLOTS packet buffers registered with it.  Datagram sends and
+ * receives go through the arena; client connections keep UR_NRECV
+ * receives posted on their UDP socket, and the server socket keeps
+ * UR_NRECVMSG. */
+#define UR_ENTRIES 1024
+#define UR_SLOTS 1024
+#define UR_NRECV 4
+#define UR_NRECVMSG 64
+
+enum {
+  UOP_READ,			/* rfd into inbuf */
+  UOP_WRITE,			/* head of outq to wfd */
+  UOP_RECV,			/* client nfd into a slot */
+  UOP_SEND,			/* slot to nfd */
+  UOP_RECVMSG,			/* server udp_socket into a slot */
+  UOP_POLL_LISTEN,		/* cevents[0] readable */
+  UOP_POLL_ERR,			/* error on stderr */
+  UOP_TIMER,			/* expiry of the worker's timerfd */
+};
+
+/* What a completion refers to; user_data points at one of these.  A
+ * retry poll linked in front of an operation carries the address of
+ * its uop with the low bit set, and its completion is ignored. */
+struct uop {
+  int kind;
+  char again;			/* last attempt returned EAGAIN */
+  struct conn *c;
+};
+
+struct uslot {
+  struct uop op;		/* must come first */
+  int next;			/* free list link */
+  struct msghdr msg;		/* for UOP_SEND and UOP_RECVMSG */
+  struct iovec iov;
+  struct sockaddr_storage ss;
+};
+
+/* Token buckets for rate limiting.  Tokens are kept in
+ * byte-nanoseconds, so refilling at any rate is exact, and a bucket
+ * holds at most TB_BURST_NS worth of its rate. */
+#define TB_BURST_NS 10000000
+#define TB_BURST_MIN (4 * sizeof (packet_t))
+
+struct tbucket {
+  uint64_t rate;		/* bytes per second, 0 for unlimited */
+  uint64_t tokens;
+  uint64_t stamp;		/* now_ns of the last refill */
+};
 
 struct chunk {
   struct chunk *next;
@@ -66,6 +184,38 @@ struct chunk {
 };
 typedef struct chunk chunk_t;
 
+/* Output chunks up to CHUNK_POOL_SIZE bytes, which is everything
+ * reliable.c ever writes in one go, come from chunk_pool */
+#define CHUNK_POOL_SIZE 512
+static pool_t chunk_pool = POOL_INIT ("chunk",
+				      offsetof (chunk_t, buf[CHUNK_POOL_SIZE]));
+
+static size_t
+chunk_alloc_size (size_t n)
+{
+  return n <= CHUNK_POOL_SIZE ? chunk_pool.size : offsetof (chunk_t, buf[n]);
+}
+
+/* Chunks are charged to acct as MEM_OUTPUT while they exist */
+static chunk_t *
+chunk_new (memacct_t *acct, size_t n)
+{
+  mem_charge (acct, MEM_OUTPUT, chunk_alloc_size (n));
+  if (n <= CHUNK_POOL_SIZE)
+    return pool_alloc (&chunk_pool);
+  return xmalloc (offsetof (chunk_t, buf[n]));
+}
+
+static void
+chunk_free (memacct_t *acct, chunk_t *ch)
+{
+  mem_charge (acct, MEM_OUTPUT, -(long) chunk_alloc_size (ch->size));
+  if (ch->size <= CHUNK_POOL_SIZE)
+    pool_free (&chunk_pool, ch);
+  else
+    free (ch);
+}
+
 struct conn {
   rel_t *rel;			/* Data from reliable */
 
@@ -81,18 +231,109 @@ struct conn {
 
   char read_eof;	        /* zero if haven't received EOF */
   char write_eof;		/* send EOF when output queue drained */
+  char eof_pending;		/* EOF waits for an outq_ring slot */
   char write_err;	        /* zero if it's okay to write to wfd */
   char xoff;			/* non-zero to pause reading */
   char delete_me;		/* delete after draining */
+  char inbuf_eof;		/* EOF or error seen behind buffered input */
+  char *inbuf;			/* block-read input (INBUF_SIZE bytes) */
+  size_t inbuf_off;		/* next byte to hand to conn_input */
+  size_t inbuf_len;		/* bytes valid in inbuf */
+  char *inmap;			/* mapping of a regular-file rfd, or NULL */
+  size_t inmap_size;		/* length of the mapping */
+  size_t inmap_pos;		/* next byte of inmap for conn_input */
+  size_t inmap_ra;		/* WILLNEED issued below this offset */
+  size_t inmap_drop;		/* DONTNEED issued below this offset */
+  char outfile;			/* wfd is a regular file written by offset */
+  int outfile_rfd;		/* readable descriptor for the same file */
+  off_t outfile_base;		/* wfd offset of the first output byte */
+  off_t outfile_len;		/* output bytes final so far */
   chunk_t *outq;		/* chunks not yet written */
   chunk_t **outqtail;
 
+  cbq_t *inq;			/* pipelined mode: chunks read from rfd */
+  size_t inq_used;		/* bytes of the head inq chunk consumed */
+  cbq_t *outq_ring;		/* pipelined mode: chunks to write to wfd */
+  size_t outq_bytes;		/* bytes in outq_ring (atomic) */
+  int efd;			/* eventfd the io thread wakes us with */
+  int io_efd;			/* eventfd we wake the io thread with */
+  int io_sleeping;		/* io thread is going to poll (atomic) */
+  int io_stop;			/* io thread should exit (atomic) */
+  pthread_t io_thread;
+
+  struct uop uread;		/* io_uring backend: READ of rfd */
+  struct uop uwrite;		/* io_uring backend: WRITE of wfd */
+  char ureading;		/* uread is in flight */
+  char uwriting;		/* uwrite is in flight */
+  char ucancel;			/* cancellation requested for delete_me */
+  int urecvs;			/* UOP_RECVs posted on nfd */
+  int upending;			/* operations referring to us in flight */
+
+  struct tbucket tb;		/* limits this connection's sends */
+
+  memacct_t mem;		/* memory held, see stats.h */
+
   struct conn *next;		/* Linked list of connections */
   struct conn **prev;
 };
 
-static conn_t *conn_list;
-struct timespec last_timeout;
+static pool_t conn_pool = POOL_INIT ("conn_t", sizeof (conn_t));
+
+/* Everything an event loop owns.  Each thread running conn_poll has
+ * its own, so worker threads in server mode never share connections,
+ * sockets or timers. */
+struct worker {
+  pthread_t thread;
+  struct config_server *serverconf; /* this worker's server config */
+  conn_t *conn_list;
+  int cevents_generation;
+  int last_cg;
+  struct pollfd *cevents;
+  int ncevents;
+  conn_t **evreaders;
+  conn_t **evwriters;
+  uint64_t last_timeout;		/* now_ns of the last periodic rel_timer */
+  int tfd;			/* timerfd waking us for rel_timer, or -1 */
+  uint64_t tfd_armed;		/* expiry tfd is currently set to */
+  uint64_t deadline;		/* earliest request_timer_at, or zero */
+  impair_t *impair;		/* sends go through this, if not NULL */
+
+  struct uring *ring;		/* io_uring backend, or NULL for poll */
+  char *uarena;			/* UR_SLOTS packet buffers */
+  struct uslot *uslot;		/* one per arena buffer */
+  int ufree;			/* first free slot, or -1 */
+  int ufixed;			/* uarena is registered with ring */
+  int urecvmsgs;		/* UOP_RECVMSGs posted on udp_socket */
+  struct uop upoll[2];		/* UOP_POLL_LISTEN, UOP_POLL_ERR */
+  char upolled[2];		/* upoll[i] is in flight */
+  struct uop utimer;		/* UOP_TIMER */
+  char utiming;			/* utimer is in flight */
+  uint64_t uticks;		/* what utimer reads from tfd */
+
+  struct tbucket tb;		/* this worker's share of the global rate */
+  int rate_gen;			/* rate_generation the buckets reflect */
+
+  /* With a control socket, the worker holds lock except while it
+   * waits for events, so the control thread can look at its
+   * connections in between.  Mutexes aren't fair, so a busy worker
+   * could take lock straight back every time; snap_waiting counts the
+   * snapshots that want it, and the worker waits on handoff for them
+   * before carrying on. */
+  pthread_mutex_t lock;
+  pthread_cond_t handoff;
+  int snap_waiting;
+  int id;
+  struct worker *wnext;		/* worker_list */
+};
+
+static struct worker main_worker;
+static struct worker *worker_list;	/* workers the control thread sees */
+static int worker_count;
+static pthread_mutex_t worker_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct worker *wk = &main_worker;
+
+__thread uint64_t rlib_now;
+__thread uint64_t rlib_pass;
 
 #if !DMALLOC
 void *
@@ -132,10 +373,8 @@ clock_gettime (int id, struct timespec *tp)
 void
 print_pkt (const packet_t *buf, const char *op, int n)
 {
-  static int pid = -1;
+  int pid = debug_pid;
   int saved_errno = errno;
-  if (pid == -1)
-    pid = getpid ();
   if (n < 0) {
     if (errno != EAGAIN)
       fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
@@ -153,88 +392,88 @@ print_pkt (const packet_t *buf, const char *op, int n)
   errno = saved_errno;
 }
 
-void flipbit(const void *data_, size_t bit) {
-  char *data = ((char *) data_);
-  unsigned int mask = 1 << (bit % 8);
-  data[bit/8] ^= mask;
+/* Records event for pkt in the trace, to or from the peer at ss. */
+static void
+trace_addr (const struct sockaddr_storage *ss, int event,
+	    const packet_t *pkt, int n)
+{
+  const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+
+  if (ss->ss_family == AF_INET)
+    trace_record (event, pkt, n, sin->sin_addr.s_addr, sin->sin_port);
+  else
+    trace_record (event, pkt, n, 0, 0);
 }
 
-int rand_percent(int fork_level)
+void
+conn_trace (conn_t *c, int event, const packet_t *pkt, int n)
 {
-  #define SALT (0x12345)
-  return (rand() + (fork_level * SALT)) % 100;
+  trace_addr (&c->peer, event, pkt, n);
 }
 
-int
-conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+/* Sends pkt to c's peer right now */
+static int
+conn_transmit (conn_t *c, const packet_t *pkt, size_t len)
 {
-  int n;
-  assert (!c->delete_me);
+  int n = -1;
 
-  int fork_level = 0;
-  bool am_i_forked = false;
+  if (wk->ring)
+    n = conn_uring_send (c, pkt, len);
+  if (n < 0 && c->server)
+    n = sendto (c->nfd, pkt, len, 0,
+		(const struct sockaddr *) &c->peer, addrsize (&c->peer));
+  else if (n < 0)
+    n = send (c->nfd, pkt, len, 0);
+  if (opt_debug)
+    print_pkt (pkt, "send", n);
+  return n;
+}
 
-  /* packet drop */
-  if (rand_percent(fork_level) < opt_drop) {
-    if (opt_debug)
-      print_pkt(pkt, "dropping: ", len);
-    return len;
-  }
+/* Sends whatever the impairment stage has due by now */
+static void
+conn_impair_drain (void)
+{
+  packet_t pkt;
+  void *dest;
+  int n;
 
-  /* packet duplication */
-  if (rand_percent(fork_level) < opt_duplicate) {
-    if (opt_debug)
-      print_pkt(pkt, "duplicating: ", len);
+  while ((n = impair_due (wk->impair, now_ns (), &dest, &pkt)) >= 0)
+    conn_transmit (dest, &pkt, n);
+}
 
-    if (fork() == 0) {
-      am_i_forked = true;
-      fork_level++;
-    }
-  }
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  assert (!c->delete_me);
 
-  /* packet delay */
-  bool do_delay = rand_percent(fork_level) < opt_delay;
-  if (do_delay) {
-    if (opt_debug)
-      print_pkt(pkt,"delaying: ", len);
-    
-    if (fork() == 0) {
-      am_i_forked = true;
-      fork_level++;
-      sleep(rand() % 5);
-    } else if (am_i_forked) {
-      exit(0);
-    } else {
+  if (wk->impair)
+    switch (impair_packet (wk->impair, now_ns (), c, pkt, len)) {
+    case IMPAIR_DROP:
+      if (opt_debug)
+	print_pkt (pkt, "dropping: ", len);
+      if (trace_on ())
+	conn_trace (c, TRACE_DROP, pkt, len);
+      return len;
+    case IMPAIR_QUEUED:
+      if (opt_debug)
+	print_pkt (pkt, "delaying: ", len);
+      conn_impair_drain ();
       return len;
     }
-  }
-
-  /* packet corruption */
-  bool do_corrupt = rand_percent(fork_level) < opt_corrupt;
-  int bit = (rand() + getpid())  % (len * 8 - 1);
-  if (do_corrupt) {
-    if (opt_debug)
-      print_pkt(pkt, "corrupting: ", len);
-    flipbit(pkt,bit);
-  }
-
-  if (c->server)
-    n = sendto (c->nfd, pkt, len, 0,
-    (const struct sockaddr *) &c->peer, addrsize (&c->peer));
-  else
-    n = send (c->nfd, pkt, len, 0);
-  if (opt_debug)
-    print_pkt (pkt, "send", n);
 
-  /* corruption cleanup */
-  if (do_corrupt) 
-    flipbit(pkt, bit); // undo changes.
-
-  /* cleanup child processes */
-  if (am_i_forked)
-    exit(0);
+  return conn_transmit (c, pkt, len);
+}
 
-  return n;
+/* Appends n bytes of buf to the -l log *lgp, unless it isn't open */
+static void
+log_write (logger_t **lgp, const void *buf, size_t n)
+{
+  if (!__atomic_load_n (lgp, __ATOMIC_RELAXED))
+    return;
+  pthread_rwlock_rdlock (&log_lock);
+  if (*lgp)
+    logger_write (*lgp, buf, n);
+  pthread_rwlock_unlock (&log_lock);
 }
 
 size_t
@@ -244,12 +483,226 @@ conn_bufspace (conn_t *c)
   size_t used = 0;
   const size_t bufsize = 8192;
 
+  if (c->outq_ring) {
+    size_t slots = IOQ_OUT - cbq_count (c->outq_ring);
+    used = __atomic_load_n (&c->outq_bytes, __ATOMIC_RELAXED);
+    if (used > bufsize)
+      return 0;
+    return (bufsize - used < slots * IOCHUNK_OUT
+	    ? bufsize - used : slots * IOCHUNK_OUT);
+  }
 
   for (ch = c->outq; ch; ch = ch->next)
     used += (ch->size - ch->used);
   return used > bufsize ? 0 : bufsize - used;
 }
 
+/* Wake the io thread if it is sleeping, or about to.  Pairs with the
+ * sequentially consistent store of io_sleeping in conn_io_thread, so
+ * either we see it sleeping or it sees what we just queued. */
+static void
+conn_io_wake (conn_t *c)
+{
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&c->io_sleeping, __ATOMIC_SEQ_CST))
+    eventfd_write (c->io_efd, 1);
+}
+
+/* conn_output for pipelined mode: copy into outq_ring chunks for the
+ * io thread to write.  Returns how many bytes fit. */
+static int
+conn_output_ring (conn_t *c, const char *buf, size_t n)
+{
+  struct iochunk_out *ch;
+  size_t done = 0;
+
+  do {
+    size_t len = n - done < IOCHUNK_OUT ? n - done : IOCHUNK_OUT;
+    if (!(ch = cbq_reserve (c->outq_ring)))
+      break;
+    ch->len = len;
+    memcpy (ch->data, buf + done, len);
+    __atomic_fetch_add (&c->outq_bytes, len, __ATOMIC_RELAXED);
+    cbq_push (c->outq_ring);
+    done += len;
+  } while (done < n);
+
+  conn_io_wake (c);
+  return done;
+}
+
+/* Queue the zero-length chunk that has the io thread shut down wfd.
+ * If outq_ring is full, conn_io_ready tries again once the io thread
+ * has written something and freed a slot. */
+static void
+conn_output_ring_eof (conn_t *c)
+{
+  struct iochunk_out *ch;
+
+  if (!(ch = cbq_reserve (c->outq_ring))) {
+    c->eof_pending = 1;
+    return;
+  }
+  c->eof_pending = 0;
+  ch->len = 0;
+  cbq_push (c->outq_ring);
+  conn_io_wake (c);
+}
+
+/* Write as much of outq_ring to wfd as possible with one writev.
+ * Returns 1 if anything was written, 0 if nothing was queued, and -1
+ * if wfd would block. */
+static int
+conn_io_write (conn_t *c, size_t *used)
+{
+  struct iovec iov[IOQ_OUT];
+  struct iochunk_out *ch;
+  int i, n;
+  ssize_t r;
+
+  for (n = 0; n < IOQ_OUT && (ch = cbq_peek (c->outq_ring, n)); n++) {
+    if (ch->len == 0)
+      break;
+    iov[n].iov_base = ch->data + (n ? 0 : *used);
+    iov[n].iov_len = ch->len - (n ? 0 : *used);
+  }
+
+  if (n == 0) {
+    if (!(ch = cbq_peek (c->outq_ring, 0)))
+      return 0;
+    shutdown (c->wfd, SHUT_WR);	/* EOF */
+    cbq_pop (c->outq_ring, 1);
+    return 1;
+  }
+
+  if (__atomic_load_n (&c->write_err, __ATOMIC_RELAXED))
+    r = *used = 0;
+  else if ((r = writev (c->wfd, iov, n)) < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return -1;
+    perror ("write");
+    __atomic_store_n (&c->write_err, 1, __ATOMIC_RELAXED);
+    r = *used = 0;
+  }
+
+  /* After an error, everything queued is simply thrown away */
+  for (i = 0; i < n; i++) {
+    size_t left = iov[i].iov_len;
+    if (!__atomic_load_n (&c->write_err, __ATOMIC_RELAXED)) {
+      if ((size_t) r < left) {
+	*used += r;
+	break;
+      }
+      r -= left;
+    }
+    ch = cbq_peek (c->outq_ring, 0);
+    __atomic_fetch_sub (&c->outq_bytes, ch->len, __ATOMIC_RELAXED);
+    cbq_pop (c->outq_ring, 1);
+    *used = 0;
+  }
+  return 1;
+}
+
+/* The io thread of a pipelined connection: fills inq from rfd, and
+ * drains outq_ring to wfd, poking the event loop through efd whenever
+ * it has made progress. */
+static void *
+conn_io_thread (void *_c)
+{
+  conn_t *c = _c;
+  struct iochunk_in *ch;
+  struct pollfd pfd[3];
+  size_t used = 0;
+  int in_eof = 0, out_blocked;
+
+  while (!__atomic_load_n (&c->io_stop, __ATOMIC_ACQUIRE)) {
+    int did = 0;
+
+    while (!in_eof && (ch = cbq_reserve (c->inq))) {
+      int r = read (c->rfd, ch->data, sizeof (ch->data));
+      if (r < 0 && (errno == EAGAIN || errno == EINTR))
+	break;
+      if (r <= 0) {
+	ch->len = -1;
+	in_eof = 1;
+      }
+      else
+	ch->len = r;
+      cbq_push (c->inq);
+      did = 1;
+    }
+
+    while ((out_blocked = conn_io_write (c, &used)) > 0)
+      did = 1;
+
+    if (did) {
+      eventfd_write (c->efd, 1);
+      continue;
+    }
+
+    /* Nothing to do: announce we're going to sleep, then check again
+     * in case the event loop queued something in between. */
+    __atomic_store_n (&c->io_sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if ((cbq_count (c->outq_ring) && !out_blocked)
+	|| __atomic_load_n (&c->io_stop, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n (&c->io_sleeping, 0, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    pfd[0].fd = in_eof || cbq_count (c->inq) >= IOQ_IN ? -1 : c->rfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = out_blocked ? c->wfd : -1;
+    pfd[1].events = POLLOUT;
+    pfd[2].fd = c->io_efd;
+    pfd[2].events = POLLIN;
+    poll (pfd, 3, -1);
+
+    __atomic_store_n (&c->io_sleeping, 0, __ATOMIC_RELAXED);
+    if (pfd[2].revents) {
+      eventfd_t v;
+      eventfd_read (c->io_efd, &v);
+    }
+  }
+  return NULL;
+}
+
+/* Switch a connection to pipelined mode, with its own io thread doing
+ * all reads of rfd and writes of wfd. */
+static void
+conn_start_io (conn_t *c)
+{
+  c->inq = cbq_new (IOQ_IN, sizeof (struct iochunk_in));
+  c->outq_ring = cbq_new (IOQ_OUT, sizeof (struct iochunk_out));
+  mem_charge (&c->mem, MEM_INPUT, IOQ_IN * sizeof (struct iochunk_in));
+  mem_charge (&c->mem, MEM_OUTPUT, IOQ_OUT * sizeof (struct iochunk_out));
+  if ((c->efd = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0
+      || (c->io_efd = eventfd (0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+    perror ("eventfd");
+    exit (1);
+  }
+  if ((errno = pthread_create (&c->io_thread, NULL, conn_io_thread, c))) {
+    perror ("pthread_create");
+    exit (1);
+  }
+  wk->cevents_generation++;
+}
+
+/* Called by conn_poll when the io thread has made progress. */
+static void
+conn_io_ready (conn_t *c)
+{
+  eventfd_t v;
+
+  eventfd_read (c->efd, &v);
+  if (c->eof_pending)
+    conn_output_ring_eof (c);
+  if (!c->read_eof && cbq_count (c->inq))
+    rel_read (c->rel);
+  if (!c->delete_me)
+    rel_output (c->rel);
+}
+
 int
 conn_output (conn_t *c, const void *_buf, size_t _n)
 {
@@ -260,7 +713,11 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 
   if (n == 0) {
     c->write_eof = 1;
-    if (!c->outq)
+    if (c->outfile)
+      ftruncate (c->wfd, c->outfile_base + c->outfile_len);
+    if (c->outq_ring)
+      conn_output_ring_eof (c);
+    else if (!c->outq)
       shutdown (c->wfd, SHUT_WR);
     return 0;
   }
@@ -275,10 +732,12 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   if (!conn_bufspace (c))
     return 0;
 
-  if (log_out >= 0)
-    write (log_out, buf, n);
+  log_write (&log_out, buf, n);
 
-  if (!c->outq) {
+  if (c->outq_ring)
+    return conn_output_ring (c, buf, n);
+
+  if (!c->outq && !wk->ring) {
     int r = write (c->wfd, buf, n);
     if (r < 0) {
       if (errno != EAGAIN) {
@@ -294,7 +753,7 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   }
 
   if (n > 0) {
-    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
+    chunk_t *ch = chunk_new (&c->mem, n);
     ch->next = NULL;
     ch->size = n;
     ch->used = 0;
@@ -303,51 +762,312 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     c->outqtail = &ch->next;
   }
 
-  if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
+  if (wk->ring)
+    conn_uring_write (c);
+  else if (c->wpoll && c->outq)
+    wk->cevents[c->wpoll].events |= POLLOUT;
+  return _n;
+}
+
+/* Refill a connection's input buffer with a single read, keeping any
+ * unconsumed tail at the front.  Returns the read result. */
+static int
+conn_fill_input (conn_t *c)
+{
+  size_t avail = c->inbuf_len - c->inbuf_off;
+  int r;
+
+  if (!c->inbuf) {
+    c->inbuf = xmalloc (INBUF_SIZE);
+    mem_charge (&c->mem, MEM_INPUT, INBUF_SIZE);
+  }
+  if (avail && c->inbuf_off)
+    memmove (c->inbuf, c->inbuf + c->inbuf_off, avail);
+  c->inbuf_off = 0;
+  c->inbuf_len = avail;
+
+  r = read (c->rfd, c->inbuf + avail, INBUF_SIZE - avail);
+  if (r == 0 || (r < 0 && errno != EAGAIN))
+    c->inbuf_eof = 1;
+  else if (r > 0)
+    c->inbuf_len += r;
+  return r;
+}
+
+/* If rfd is a regular file, map it so conn_input can copy straight
+ * from the page cache instead of reading into inbuf.  Mapping starts
+ * at the page holding the descriptor's current offset. */
+static void
+conn_map_input (conn_t *c)
+{
+  struct stat sb;
+  off_t off, base;
+  void *p;
+
+  if (fstat (c->rfd, &sb) < 0 || !S_ISREG (sb.st_mode))
+    return;
+  if ((off = lseek (c->rfd, 0, SEEK_CUR)) < 0)
+    off = 0;
+  if (sb.st_size <= off)
+    return;
+
+  base = off & ~((off_t) sysconf (_SC_PAGESIZE) - 1);
+  p = mmap (NULL, sb.st_size - base, PROT_READ, MAP_SHARED, c->rfd, base);
+  if (p == MAP_FAILED) {
+    perror ("mmap");
+    return;
+  }
+  madvise (p, sb.st_size - base, MADV_SEQUENTIAL);
+  posix_fadvise (c->rfd, base, 0, POSIX_FADV_SEQUENTIAL);
+
+  c->inmap = p;
+  c->inmap_size = sb.st_size - base;
+  c->inmap_pos = off - base;
+  c->inmap_ra = c->inmap_drop = 0;
+}
+
+/* conn_input for mapped files.  Data is always available, so rfd is
+ * never polled again and the reliable side pulls input as it needs
+ * it. */
+static int
+conn_input_map (conn_t *c, void *buf, size_t n)
+{
+  size_t avail = c->inmap_size - c->inmap_pos;
+
+  if (!avail) {
+    errno = EIO;
+    c->read_eof = 1;
+    return -1;
+  }
+  if (n > avail)
+    n = avail;
+
+  while (c->inmap_ra < c->inmap_size
+	 && c->inmap_ra < c->inmap_pos + n + INMAP_WINDOW / 2) {
+    size_t len = c->inmap_size - c->inmap_ra;
+    if (len > INMAP_WINDOW)
+      len = INMAP_WINDOW;
+    madvise (c->inmap + c->inmap_ra, len, MADV_WILLNEED);
+    c->inmap_ra += len;
+  }
+  while (c->inmap_drop + 2 * INMAP_WINDOW <= c->inmap_pos) {
+    madvise (c->inmap + c->inmap_drop, INMAP_WINDOW, MADV_DONTNEED);
+    c->inmap_drop += INMAP_WINDOW;
+  }
+
+  memcpy (buf, c->inmap + c->inmap_pos, n);
+  c->inmap_pos += n;
+  log_write (&log_in, buf, n);
+  return n;
+}
+
+/* conn_input for pipelined mode: hand out data from the chunks the io
+ * thread has read, releasing each chunk once it's used up. */
+static int
+conn_input_ring (conn_t *c, void *buf, size_t n)
+{
+  struct iochunk_in *ch = cbq_peek (c->inq, 0);
+
+  if (!ch)
+    return 0;
+  if (ch->len < 0) {
+    errno = EIO;
+    c->read_eof = 1;
+    return -1;
+  }
+
+  if (n > ch->len - c->inq_used)
+    n = ch->len - c->inq_used;
+  memcpy (buf, ch->data + c->inq_used, n);
+  c->inq_used += n;
+  if (c->inq_used == ch->len) {
+    c->inq_used = 0;
+    cbq_pop (c->inq, 1);
+    conn_io_wake (c);
+  }
+  log_write (&log_in, buf, n);
+  return n;
+}
+
+int
+conn_input_mapped (conn_t *c)
+{
+  return c->inmap != NULL;
+}
+
+/* If wfd is an empty-from-here regular file (and not in append mode or
+ * being logged), let the reliable side place output at explicit
+ * offsets instead of streaming it through outq. */
+static void
+conn_sink_output (conn_t *c)
+{
+  struct stat sb;
+  off_t off;
+  int fl;
+
+  if (__atomic_load_n (&log_out, __ATOMIC_RELAXED)
+      || fstat (c->wfd, &sb) < 0 || !S_ISREG (sb.st_mode))
+    return;
+  if ((fl = fcntl (c->wfd, F_GETFL)) < 0 || (fl & O_APPEND))
+    return;
+  if ((off = lseek (c->wfd, 0, SEEK_CUR)) < 0 || sb.st_size > off)
+    return;
+
+  /* Output placed ahead of a short packet has to be read back to be
+   * moved, and stdout is usually opened write-only. */
+  if ((fl & O_ACCMODE) == O_RDWR)
+    c->outfile_rfd = c->wfd;
+  else {
+    char name[40];
+    snprintf (name, sizeof (name), "/proc/self/fd/%d", c->wfd);
+    if ((c->outfile_rfd = open (name, O_RDONLY)) < 0)
+      return;
+  }
+
+  c->outfile = 1;
+  c->outfile_base = off;
+  c->outfile_len = 0;
+}
+
+int
+conn_output_seekable (conn_t *c)
+{
+  return c->outfile;
+}
+
+int
+conn_output_at (conn_t *c, long long off, const void *_buf, size_t _n)
+{
+  const char *buf = _buf;
+  size_t n = _n;
+
+  assert (c->outfile && !c->delete_me && !c->write_eof);
+
+  if (c->write_err)
+    return -1;
+
+  while (n > 0) {
+    ssize_t r = pwrite (c->wfd, buf, n, c->outfile_base + off);
+    if (r < 0) {
+      if (errno == EINTR)
+	continue;
+      perror ("pwrite");
+      c->write_err = 2;
+      return -1;
+    }
+    buf += r;
+    off += r;
+    n -= r;
+  }
   return _n;
 }
 
+int
+conn_output_move (conn_t *c, long long from, long long to, size_t n)
+{
+  char buf[8192];
+  size_t done;
+
+  assert (c->outfile && !c->delete_me && !c->write_eof);
+
+  if (c->write_err)
+    return -1;
+
+  for (done = 0; done < n; ) {
+    size_t len = n - done < sizeof (buf) ? n - done : sizeof (buf);
+    ssize_t r = pread (c->outfile_rfd, buf, len,
+		       c->outfile_base + from + done);
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR)
+	continue;
+      perror ("pread");
+      c->write_err = 2;
+      return -1;
+    }
+    if (conn_output_at (c, to + done, buf, r) < 0)
+      return -1;
+    done += r;
+  }
+  return n;
+}
+
+void
+conn_output_commit (conn_t *c, long long len)
+{
+  assert (c->outfile && len >= c->outfile_len);
+  c->outfile_len = len;
+}
+
 int
 conn_input (conn_t *c, void *buf, size_t n)
 {
-  int r;
+  size_t avail;
   assert (!c->delete_me);
 
   if (c->read_eof)
     return -1;
-  r = read (c->rfd, buf, n);
-  if (r == 0 || (r < 0 && errno != EAGAIN)) {
-    if (r == 0)
-      errno = EIO;
-    r = -1;
+  if (c->inmap)
+    return conn_input_map (c, buf, n);
+  if (c->inq)
+    return conn_input_ring (c, buf, n);
+
+  /* Only touch the descriptor when the buffer can't fill the whole
+   * request, so packets are carved out of one large read. */
+  avail = c->inbuf_len - c->inbuf_off;
+  if (avail < n && !c->inbuf_eof) {
+    /* With io_uring, top the buffer up first as poll does, so a bulk
+     * stream isn't cut into a short packet at every block boundary,
+     * and only post a read (which calls rel_read when it lands) once
+     * there's nothing more to be had right now */
+    if (!c->ureading) {
+      conn_fill_input (c);
+      avail = c->inbuf_len - c->inbuf_off;
+    }
+    if (wk->ring && avail < n && !c->inbuf_eof)
+      conn_uring_read (c);
+  }
+
+  if (!avail && c->inbuf_eof) {
+    errno = EIO;
     c->read_eof = 1;
-    return r;
+    if (c->inbuf)
+      mem_charge (&c->mem, MEM_INPUT, -INBUF_SIZE);
+    free (c->inbuf);
+    c->inbuf = NULL;
+    c->inbuf_off = c->inbuf_len = 0;
+    return -1;
   }
-  if (r < 0 && errno == EAGAIN)
-    r = 0;
 
-  if (r > 0 && log_in >= 0)
-    write (log_in, buf, r);
+  if (n > avail)
+    n = avail;
+  if (n > 0) {
+    memcpy (buf, c->inbuf + c->inbuf_off, n);
+    c->inbuf_off += n;
+    if (c->inbuf_off == c->inbuf_len && !c->ureading)
+      c->inbuf_off = c->inbuf_len = 0;
+    log_write (&log_in, buf, n);
+  }
 
   c->xoff = 0;
-  cevents[c->rpoll].events |= POLLIN;
-  return r;
+  wk->cevents[c->rpoll].events |= POLLIN;
+  return n;
 }
 
 static conn_t *
 conn_alloc (void)
 {
-  conn_t *c = xmalloc (sizeof (*c));
+  conn_t *c = pool_alloc (&conn_pool);
   memset (c, 0, sizeof (*c));
-  c->prev = &conn_list;
-  c->next = conn_list;
+  mem_charge (&c->mem, MEM_CONN, sizeof (*c));
+  c->prev = &wk->conn_list;
+  c->next = wk->conn_list;
   c->outqtail = &c->outq;
-  if (conn_list)
-    conn_list->prev = &c->next;
-  conn_list = c;
+  c->tb.rate = __atomic_load_n (&opt_conn_rate, __ATOMIC_RELAXED);
+  if (wk->conn_list)
+    wk->conn_list->prev = &c->next;
+  wk->conn_list = c;
 
-  cevents_generation++;
+  wk->cevents_generation++;
 
   return c;
 }
@@ -361,14 +1081,14 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
   /* conn_create is only when the program is running as a server (and
    * rel_recvpkt is called with NULL packets.  If you call conn_create
    * in the client, you will see this assertion fail. */
-  assert (serverconf);
+  assert (wk->serverconf);
 
-  if ((n = connect_to (0, &serverconf->dest)) < 0) {
+  if ((n = connect_to (0, &wk->serverconf->dest)) < 0) {
     char addr[NI_MAXHOST] = "unknown";
     char port[NI_MAXSERV] = "unknown";
     int saved_errno = errno;
-    getnameinfo ((const struct sockaddr *) &serverconf->dest,
-		 sizeof (serverconf->dest),
+    getnameinfo ((const struct sockaddr *) &wk->serverconf->dest,
+		 sizeof (wk->serverconf->dest),
 		 addr, sizeof (addr), port, sizeof (port),
 		 NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
     fprintf (stderr, "%s:%s: connect: %s\n",
@@ -379,7 +1099,7 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
   c = conn_alloc ();
   c->peer = *ss;
   c->rel = rel;
-  c->nfd = serverconf->udp_socket;
+  c->nfd = wk->serverconf->udp_socket;
   c->rfd = c->wfd = n;
   c->server = 1;
 
@@ -391,26 +1111,53 @@ conn_free (conn_t *c)
 {
   chunk_t *ch, *nch;
 
+  if (c->inq) {
+    __atomic_store_n (&c->io_stop, 1, __ATOMIC_SEQ_CST);
+    eventfd_write (c->io_efd, 1);
+    pthread_join (c->io_thread, NULL);
+    close (c->efd);
+    close (c->io_efd);
+    cbq_destroy (c->inq);
+    cbq_destroy (c->outq_ring);
+    mem_charge (&c->mem, MEM_INPUT, -(long) (IOQ_IN * sizeof (struct iochunk_in)));
+    mem_charge (&c->mem, MEM_OUTPUT,
+		-(long) (IOQ_OUT * sizeof (struct iochunk_out)));
+  }
+
   for (ch = c->outq; ch; ch = nch) {
     nch = ch->next;
-    free (ch);
+    chunk_free (&c->mem, ch);
   }
+  if (c->inbuf)
+    mem_charge (&c->mem, MEM_INPUT, -INBUF_SIZE);
+  free (c->inbuf);
+  if (c->inmap)
+    munmap (c->inmap, c->inmap_size);
+  if (c->outfile && c->outfile_rfd != c->wfd)
+    close (c->outfile_rfd);
 
   if (c->next)
     c->next->prev = c->prev;
   *c->prev = c->next;
 
+  /* Queued SQEs name descriptors by number, so hand them to the
+   * kernel before closing ours */
+  if (wk->ring)
+    uring_submit_wait (wk->ring, 0, 0);
+
   close (c->rfd);
   if (c->wfd != c->rfd)
     close (c->wfd);
   if (!c->server)
     close (c->nfd);
 
-  cevents_generation++;
+  wk->cevents_generation++;
+
+  mem_charge (&c->mem, MEM_CONN, -(long) sizeof (*c));
 
   /* to help catch errors */
   memset (c, 0xc5, sizeof (*c));
-  free (c);
+  pool_free (&conn_pool, c);
 }
 
 void
@@ -426,7 +1173,7 @@ conn_drain (conn_t *c)
   int didsome = 0;
 
   if (c->wpoll)
-    cevents[c->wpoll].events &= ~POLLOUT;
+    wk->cevents[c->wpoll].events &= ~POLLOUT;
 
   if (c->write_err)
     return;
@@ -443,13 +1190,13 @@ conn_drain (conn_t *c)
     ch->used += n;
     if (ch->used < ch->size) {
       if (c->wpoll)
-	cevents[c->wpoll].events |= POLLOUT;
+	wk->cevents[c->wpoll].events |= POLLOUT;
       break;
     }
     c->outq = ch->next;
     if (!c->outq)
       c->outqtail = &c->outq;
-    free (ch);
+    chunk_free (&c->mem, ch);
   }
   if (c->write_eof && !c->write_err && !c->outq) {
     c->write_err = 1;
@@ -464,11 +1211,17 @@ conn_mkevents (void)
 {
   struct pollfd *e;
   conn_t **r, **w;
-  size_t n = 2;
+  size_t n = 3;
   conn_t *c;
 
-  for (c = conn_list; c; c = c->next) {
-    if (c->read_eof) {
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->inq) {
+      /* The io thread does the reading and writing, and tells us
+       * about it through efd, which takes the place of rfd */
+      c->rpoll = n++;
+      c->wpoll = 0;
+    }
+    else if (c->read_eof) {
       c->rpoll = 0;
       if (c->write_err)
 	c->wpoll = 0;
@@ -492,125 +1245,865 @@ conn_mkevents (void)
 
   e = xmalloc (n * sizeof (*e));
   memset (e, 0, n * sizeof (*e));
-  if (cevents)
-    e[0] = cevents[0];
+  if (wk->cevents)
+    e[0] = wk->cevents[0];
   else
     e[0].fd = -1;
   e[1].fd = 2;			/* Do catch errors on stderr */
+  e[2].fd = wk->tfd;		/* Time to call rel_timer */
+  e[2].events = POLLIN;
     
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll) {
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->rpoll && c->inq) {
+      e[c->rpoll].fd = c->efd;
+      e[c->rpoll].events |= POLLIN;
+    }
+    else if (c->rpoll) {
       e[c->rpoll].fd = c->rfd;
       if (!c->xoff)
 	e[c->rpoll].events |= POLLIN;
     }
-    if (c->wpoll) {
-      e[c->wpoll].fd = c->wfd;
-      if (c->outq)
-	e[c->wpoll].events |= POLLOUT;
+    if (c->wpoll) {
+      e[c->wpoll].fd = c->wfd;
+      if (c->outq)
+	e[c->wpoll].events |= POLLOUT;
+    }
+    if (c->npoll) {
+      e[c->npoll].fd = c->nfd;
+      e[c->npoll].events |= POLLIN;
+    }
+  }
+
+  r = xmalloc (n * sizeof (*r));
+  memset (r, 0, n * sizeof (*r));
+  w = xmalloc (n * sizeof (*w));
+  memset (w, 0, n * sizeof (*w));
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->rpoll > 0)
+      r[c->rpoll] = c;
+    if (c->npoll > 0)
+      r[c->npoll] = c;
+    if (c->wpoll > 0)
+      w[c->wpoll] = c;
+  }
+
+  free (wk->cevents);
+  wk->cevents = e;
+  wk->ncevents = n;
+  free (wk->evreaders);
+  wk->evreaders = r;
+  free (wk->evwriters);
+  wk->evwriters = w;
+}
+
+static void
+conn_demux (const struct config_server *cs)
+{
+  packet_t pkt;
+  struct sockaddr_storage ss;
+  int n;
+
+  memset (&ss, 0, sizeof (ss));
+  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
+    rel_demux (&cs->c, &ss, &pkt, n);
+    memset (&pkt, 0xc7, n);	     /* to help debugging */
+    memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
+  }
+  if (errno != EAGAIN)
+    perror ("UDP recv");
+}
+
+long
+need_timer_in (const struct timespec *last, long timer)
+{
+  long to;
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  to = ts.tv_sec - last->tv_sec;
+  if (to > timer / 1000)
+    return 0;
+  to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
+  if (to >= timer)
+    return 0;
+  return
+    timer - to;
+}
+
+uint64_t
+now_ns_refresh (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  rlib_now = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  return rlib_now;
+}
+
+void
+request_timer_at (uint64_t when)
+{
+  if (!wk->deadline || when < wk->deadline)
+    wk->deadline = when;
+}
+
+/* Sets the timerfd to go off at the next periodic rel_timer call or
+ * at the earliest request_timer_at deadline, whichever comes first.
+ * Returns the timeout for poll: -1 when the timerfd will wake us up,
+ * or else the milliseconds to go, rounded up. */
+static long
+conn_arm_timer (const struct config_common *cc)
+{
+  uint64_t next = wk->last_timeout + cc->timer * 1000000ULL;
+  uint64_t now;
+  struct itimerspec its;
+
+  if (wk->deadline && wk->deadline < next)
+    next = wk->deadline;
+  if (wk->impair && impair_next (wk->impair) < next)
+    next = impair_next (wk->impair);
+
+  if (wk->tfd < 0) {
+    if ((now = now_ns_refresh ()) >= next)
+      return 0;
+    return (next - now + 999999) / 1000000;
+  }
+
+  if (next != wk->tfd_armed) {
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = next / 1000000000;
+    its.it_value.tv_nsec = next % 1000000000;
+    timerfd_settime (wk->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    wk->tfd_armed = next;
+  }
+  return -1;
+}
+
+static uint64_t
+tb_burst (const struct tbucket *b)
+{
+  uint64_t burst = b->rate * TB_BURST_NS;
+  if (burst < TB_BURST_MIN * 1000000000)
+    burst = TB_BURST_MIN * 1000000000;
+  return burst;
+}
+
+static void
+tb_refill (struct tbucket *b, uint64_t now)
+{
+  uint64_t burst = tb_burst (b);
+  uint64_t dt = now - b->stamp;
+
+  b->stamp = now;
+  if (dt >= burst / b->rate || b->tokens + dt * b->rate >= burst)
+    b->tokens = burst;
+  else
+    b->tokens += dt * b->rate;
+}
+
+/* Returns how many ns from now len bytes will be available in b. */
+static uint64_t
+tb_wait (struct tbucket *b, size_t len, uint64_t now)
+{
+  uint64_t need = len * 1000000000ULL;
+
+  if (!b->rate)
+    return 0;
+  tb_refill (b, now);
+  if (b->tokens >= need)
+    return 0;
+  return (need - b->tokens + b->rate - 1) / b->rate;
+}
+
+static void
+tb_take (struct tbucket *b, size_t len)
+{
+  if (b->rate)
+    b->tokens -= len * 1000000000ULL;
+}
+
+uint64_t
+conn_send_wait (conn_t *c, size_t len)
+{
+  uint64_t now = now_ns ();
+  uint64_t w1 = tb_wait (&c->tb, len, now);
+  uint64_t w2 = tb_wait (&wk->tb, len, now);
+
+  if (!w1 && !w2) {
+    tb_take (&c->tb, len);
+    tb_take (&wk->tb, len);
+    return 0;
+  }
+  now += w1 > w2 ? w1 : w2;
+  request_timer_at (now);
+  return now;
+}
+
+/* Re-reads opt_rate_file, which holds lines of the form "conn RATE"
+ * or "global RATE" with rates in bytes per second (0 to lift the
+ * limit).  Limits not mentioned keep their current values. */
+static void
+read_rate_file (void)
+{
+  FILE *f = fopen (opt_rate_file, "r");
+  char key[32];
+  unsigned long long rate;
+
+  if (!f) {
+    perror (opt_rate_file);
+    return;
+  }
+  while (fscanf (f, "%31s %llu", key, &rate) == 2) {
+    if (!strcmp (key, "conn"))
+      __atomic_store_n (&opt_conn_rate, rate, __ATOMIC_RELAXED);
+    else if (!strcmp (key, "global"))
+      __atomic_store_n (&opt_global_rate, rate, __ATOMIC_RELAXED);
+    else
+      fprintf (stderr, "%s: unknown limit %s\n", opt_rate_file, key);
+  }
+  fclose (f);
+  __atomic_add_fetch (&rate_generation, 1, __ATOMIC_RELEASE);
+}
+
+static void
+rate_sighup (int sig)
+{
+  rate_reload = 1;
+}
+
+static void
+stats_sigusr1 (int sig)
+{
+  stats_request = 1;
+}
+
+/* Brings this worker's buckets up to date with the current limits. */
+static void
+conn_apply_rates (void)
+{
+  uint64_t rate = __atomic_load_n (&opt_conn_rate, __ATOMIC_RELAXED);
+  conn_t *c;
+
+  wk->rate_gen = __atomic_load_n (&rate_generation, __ATOMIC_ACQUIRE);
+  wk->tb.rate = (__atomic_load_n (&opt_global_rate, __ATOMIC_RELAXED)
+		 / rate_shares);
+  for (c = wk->conn_list; c; c = c->next)
+    c->tb.rate = rate;
+}
+
+/* Reports an ICMP port unreachable from c's peer, which means the
+ * other end has gone away. */
+static void
+conn_peer_dead (conn_t *c, const struct config_common *cc)
+{
+  char addr[NI_MAXHOST] = "unknown";
+  char port[NI_MAXSERV] = "unknown";
+  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+	       addr, sizeof (addr), port, sizeof (port),
+	       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+  fprintf (stderr, "[received ICMP port unreachable;"
+	   " assuming peer at %s:%s is dead]\n", addr, port);
+  if (cc->single_connection)
+    exit (1);
+  rel_destroy (c->rel);
+}
+
+/* Sets up this worker's io_uring backend if -U was given, leaving
+ * wk->ring NULL (and the poll backend in charge) if the kernel can't
+ * do it. */
+static void
+conn_uring_setup (void)
+{
+  struct uring *u;
+  size_t size = UR_SLOTS * sizeof (packet_t);
+  int i;
+
+  if (!opt_uring)
+    return;
+  u = xmalloc (sizeof (*u));
+  if (uring_init (u, UR_ENTRIES) < 0) {
+    fprintf (stderr, "%s: io_uring: %s; using poll\n",
+	     progname, strerror (errno));
+    free (u);
+    return;
+  }
+  wk->uarena = mmap (NULL, size, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (wk->uarena == MAP_FAILED) {
+    perror ("mmap");
+    exit (1);
+  }
+  wk->uslot = xmalloc (UR_SLOTS * sizeof (*wk->uslot));
+  memset (wk->uslot, 0, UR_SLOTS * sizeof (*wk->uslot));
+  for (i = 0; i < UR_SLOTS; i++)
+    wk->uslot[i].next = i + 1 < UR_SLOTS ? i + 1 : -1;
+  wk->ufree = 0;
+  /* Registration pins the arena; without it we just use the
+   * unregistered forms of the same operations. */
+  wk->ufixed = uring_register_buffer (u, wk->uarena, size) == 0;
+  wk->ring = u;
+}
+
+/* Tears down the calling thread's io_uring at exit, if it has one */
+static void
+conn_uring_exit (void)
+{
+  if (!wk->ring)
+    return;
+  uring_exit (wk->ring);
+  free (wk->ring);
+  wk->ring = NULL;
+}
+
+/* Sets up the calling thread's event loop: the timerfd that wakes it
+ * up for rel_timer and, with -U, its io_uring. */
+static void
+worker_init (void)
+{
+  now_ns_refresh ();
+  wk->tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (wk->tfd < 0)
+    perror ("timerfd_create");
+  conn_apply_rates ();
+  conn_uring_setup ();
+  if (impair_active (&impair_conf)
+      && !(wk->impair = impair_new (&impair_conf,
+				    __atomic_fetch_add (&impair_streams, 1,
+							__ATOMIC_RELAXED)))) {
+    perror ("impair_new");
+    exit (1);
+  }
+
+  if (opt_control) {
+    pthread_mutex_init (&wk->lock, NULL);
+    pthread_cond_init (&wk->handoff, NULL);
+    pthread_mutex_lock (&worker_list_lock);
+    wk->id = worker_count++;
+    wk->wnext = worker_list;
+    worker_list = wk;
+    pthread_mutex_unlock (&worker_list_lock);
+    pthread_mutex_lock (&wk->lock);
+  }
+}
+
+/* Let the control thread in while we wait for events, and keep it out
+ * again once we're back, after any snapshot it was waiting to take */
+static void
+worker_unlock (void)
+{
+  if (opt_control)
+    pthread_mutex_unlock (&wk->lock);
+}
+
+static void
+worker_lock (void)
+{
+  if (!opt_control)
+    return;
+  pthread_mutex_lock (&wk->lock);
+  while (__atomic_load_n (&wk->snap_waiting, __ATOMIC_ACQUIRE))
+    pthread_cond_wait (&wk->handoff, &wk->lock);
+}
+
+static int
+uslot_get (void)
+{
+  int i = wk->ufree;
+  if (i >= 0)
+    wk->ufree = wk->uslot[i].next;
+  return i;
+}
+
+static void
+uslot_put (int i)
+{
+  wk->uslot[i].op.c = NULL;
+  wk->uslot[i].next = wk->ufree;
+  wk->ufree = i;
+}
+
+static int
+uslot_index (struct uop *op)
+{
+  return (struct uslot *) op - wk->uslot;
+}
+
+static char *
+uslot_buf (int i)
+{
+  return wk->uarena + i * sizeof (packet_t);
+}
+
+/* Queues an operation whose completion will be handed to
+ * conn_uring_complete with op.  If the last attempt at op came back
+ * with EAGAIN, it is preceded by a linked poll for events. */
+static struct io_uring_sqe *
+conn_uring_prep (struct uop *op, int opcode, int fd, void *buf,
+		 unsigned len, int events)
+{
+  struct io_uring_sqe *sqe;
+
+  if (op->again) {
+    if (!(sqe = uring_get_sqe (wk->ring)))
+      return NULL;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uintptr_t) op | 1;
+    op->again = 0;
+  }
+  if (!(sqe = uring_get_sqe (wk->ring)))
+    return NULL;
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) buf;
+  sqe->len = len;
+  if (opcode == IORING_OP_POLL_ADD)
+    sqe->poll32_events = events;
+  if (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE
+      || opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED)
+    sqe->off = -1;		/* at the file position, like read/write */
+  sqe->user_data = (uintptr_t) op;
+  return sqe;
+}
+
+/* Starts a read of rfd into the free end of inbuf, unless one is
+ * already in flight.  conn_input hands out the data once it lands. */
+static void
+conn_uring_read (conn_t *c)
+{
+  size_t avail = c->inbuf_len - c->inbuf_off;
+
+  if (c->ureading || c->inbuf_eof || c->ucancel)
+    return;
+  if (!c->inbuf) {
+    c->inbuf = xmalloc (INBUF_SIZE);
+    mem_charge (&c->mem, MEM_INPUT, INBUF_SIZE);
+  }
+  if (avail && c->inbuf_off)
+    memmove (c->inbuf, c->inbuf + c->inbuf_off, avail);
+  c->inbuf_off = 0;
+  c->inbuf_len = avail;
+  if (avail == INBUF_SIZE)
+    return;
+
+  c->uread.kind = UOP_READ;
+  c->uread.c = c;
+  if (!conn_uring_prep (&c->uread, IORING_OP_READ, c->rfd,
+			c->inbuf + avail, INBUF_SIZE - avail, POLLIN))
+    return;
+  c->ureading = 1;
+  c->upending++;
+}
+
+/* Starts a write of the head of outq, unless one is in flight. */
+static void
+conn_uring_write (conn_t *c)
+{
+  chunk_t *ch = c->outq;
+
+  if (c->uwriting || c->write_err || !ch)
+    return;
+  c->uwrite.kind = UOP_WRITE;
+  c->uwrite.c = c;
+  if (!conn_uring_prep (&c->uwrite, IORING_OP_WRITE, c->wfd,
+			ch->buf + ch->used, ch->size - ch->used, POLLOUT))
+    return;
+  c->uwriting = 1;
+  c->upending++;
+}
+
+/* Posts a receive on a client connection's UDP socket into slot i,
+ * or into a new slot if i is -1.  Returns -1 if nothing was posted,
+ * in which case the slot has been given back. */
+static int
+conn_uring_recv (conn_t *c, int i)
+{
+  struct uslot *s;
+  struct io_uring_sqe *sqe;
+  int fresh = i < 0;
+
+  if (fresh && (i = uslot_get ()) < 0)
+    return -1;
+  s = &wk->uslot[i];
+  s->op.kind = UOP_RECV;
+  s->op.c = c;
+  sqe = conn_uring_prep (&s->op,
+			 wk->ufixed ? IORING_OP_READ_FIXED : IORING_OP_RECV,
+			 c->nfd, uslot_buf (i), sizeof (packet_t), POLLIN);
+  if (!sqe) {
+    uslot_put (i);
+    if (!fresh) {
+      c->urecvs--;
+      c->upending--;
+    }
+    return -1;
+  }
+  if (fresh) {
+    c->urecvs++;
+    c->upending++;
+  }
+  return 0;
+}
+
+/* Like conn_uring_recv, for the server's socket. */
+static int
+conn_uring_recvmsg (int i)
+{
+  struct uslot *s;
+  int fresh = i < 0;
+
+  if (fresh && (i = uslot_get ()) < 0)
+    return -1;
+  s = &wk->uslot[i];
+  s->op.kind = UOP_RECVMSG;
+  s->iov.iov_base = uslot_buf (i);
+  s->iov.iov_len = sizeof (packet_t);
+  memset (&s->msg, 0, sizeof (s->msg));
+  s->msg.msg_name = &s->ss;
+  s->msg.msg_namelen = sizeof (s->ss);
+  s->msg.msg_iov = &s->iov;
+  s->msg.msg_iovlen = 1;
+  if (!conn_uring_prep (&s->op, IORING_OP_RECVMSG,
+			wk->serverconf->udp_socket, &s->msg, 1, POLLIN)) {
+    uslot_put (i);
+    if (!fresh)
+      wk->urecvmsgs--;
+    return -1;
+  }
+  if (fresh)
+    wk->urecvmsgs++;
+  return 0;
+}
+
+/* Copies pkt into a slot and queues it for sending.  Returns len, or
+ * -1 if the caller should send it synchronously instead. */
+static int
+conn_uring_send (conn_t *c, const packet_t *pkt, size_t len)
+{
+  struct uslot *s;
+  struct io_uring_sqe *sqe;
+  int i;
+
+  if ((i = uslot_get ()) < 0)
+    return -1;
+  s = &wk->uslot[i];
+  s->op.kind = UOP_SEND;
+  memcpy (uslot_buf (i), pkt, len);
+  if (c->server) {
+    s->ss = c->peer;
+    s->iov.iov_base = uslot_buf (i);
+    s->iov.iov_len = len;
+    memset (&s->msg, 0, sizeof (s->msg));
+    s->msg.msg_name = &s->ss;
+    s->msg.msg_namelen = addrsize (&s->ss);
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    sqe = conn_uring_prep (&s->op, IORING_OP_SENDMSG, c->nfd,
+			   &s->msg, 1, 0);
+  }
+  else
+    sqe = conn_uring_prep (&s->op,
+			   wk->ufixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+			   c->nfd, uslot_buf (i), len, 0);
+  if (!sqe) {
+    uslot_put (i);
+    return -1;
+  }
+  return len;
+}
+
+static void
+conn_uring_cancel_op (struct uop *op)
+{
+  struct io_uring_sqe *sqe;
+  int retry;
+
+  for (retry = 0; retry < 2; retry++)
+    if ((sqe = uring_get_sqe (wk->ring))) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uintptr_t) op | retry;
+    }
+}
+
+/* Cancels the reads and receives still posted for a connection that
+ * is going away; conn_poll frees it once they have all completed. */
+static void
+conn_uring_cancel (conn_t *c)
+{
+  int i;
+
+  c->ucancel = 1;
+  if (c->ureading)
+    conn_uring_cancel_op (&c->uread);
+  for (i = 0; i < UR_SLOTS && c->urecvs; i++)
+    if (wk->uslot[i].op.c == c && wk->uslot[i].op.kind == UOP_RECV)
+      conn_uring_cancel_op (&wk->uslot[i].op);
+}
+
+static void
+conn_uring_complete (struct uop *op, int res, const struct config_common *cc)
+{
+  conn_t *c = op->c;
+  chunk_t *ch;
+  int i, rearm;
+
+  switch (op->kind) {
+  case UOP_READ:
+    c->ureading = 0;
+    c->upending--;
+    if (res == -ECANCELED)
+      break;
+    if (res == -EAGAIN || res == -EINTR) {
+      op->again = 1;
+      conn_uring_read (c);
+      break;
+    }
+    if (res <= 0)
+      c->inbuf_eof = 1;
+    else
+      c->inbuf_len += res;
+    if (!c->delete_me)
+      rel_read (c->rel);
+    break;
+
+  case UOP_WRITE:
+    c->uwriting = 0;
+    c->upending--;
+    if (res == -EAGAIN || res == -EINTR) {
+      op->again = 1;
+      conn_uring_write (c);
+      break;
+    }
+    if (res < 0) {
+      c->write_err = 1;
+      break;
+    }
+    ch = c->outq;
+    ch->used += res;
+    if (ch->used == ch->size) {
+      c->outq = ch->next;
+      if (!c->outq)
+	c->outqtail = &c->outq;
+      chunk_free (&c->mem, ch);
+    }
+    conn_uring_write (c);
+    if (c->write_eof && !c->write_err && !c->outq) {
+      c->write_err = 1;
+      shutdown (c->wfd, SHUT_WR);
+    }
+    if (!c->delete_me)
+      rel_output (c->rel);
+    break;
+
+  case UOP_RECV:
+    i = uslot_index (op);
+    rearm = 1;
+    if (res >= 0) {
+      if (opt_debug)
+	print_pkt ((packet_t *) uslot_buf (i), "recv", res);
+      if (trace_on ())
+	conn_trace (c, TRACE_RECV, (packet_t *) uslot_buf (i), res);
+      if (!c->delete_me)
+	rel_recvpkt (c->rel, (packet_t *) uslot_buf (i), res);
+    }
+    else if (res == -EAGAIN || res == -EINTR)
+      op->again = 1;
+    else {
+      if (res == -ECONNREFUSED && !c->delete_me)
+	conn_peer_dead (c, cc);
+      else if (res != -ECANCELED)
+	fprintf (stderr, "recv: %s\n", strerror (-res));
+      rearm = 0;
     }
-    if (c->npoll) {
-      e[c->npoll].fd = c->nfd;
-      e[c->npoll].events |= POLLIN;
+    if (!rearm || c->delete_me || conn_uring_recv (c, i) < 0) {
+      uslot_put (i);
+      c->urecvs--;
+      c->upending--;
     }
+    break;
+
+  case UOP_RECVMSG:
+    i = uslot_index (op);
+    if (res >= 0) {
+      if (opt_debug)
+	print_pkt ((packet_t *) uslot_buf (i), "recv", res);
+      if (trace_on ())
+	trace_addr (&wk->uslot[i].ss, TRACE_RECV,
+		    (packet_t *) uslot_buf (i), res);
+      rel_demux (&wk->serverconf->c, &wk->uslot[i].ss,
+		 (packet_t *) uslot_buf (i), res);
+    }
+    else if (res == -EAGAIN || res == -EINTR)
+      op->again = 1;
+    else {
+      fprintf (stderr, "UDP recv: %s\n", strerror (-res));
+      uslot_put (i);
+      wk->urecvmsgs--;
+      break;
+    }
+    conn_uring_recvmsg (i);
+    break;
+
+  case UOP_SEND:
+    /* As with send and sendto, a failure is only reported with
+     * --debug, and a dead peer shows up on the receives instead */
+    i = uslot_index (op);
+    if (res < 0 && opt_debug) {
+      errno = -res;
+      print_pkt ((packet_t *) uslot_buf (i), "send", res);
+    }
+    uslot_put (i);
+    break;
+
+  case UOP_POLL_LISTEN:
+    wk->upolled[0] = 0;
+    if (res > 0)
+      wk->cevents[0].revents = res;
+    break;
+
+  case UOP_TIMER:
+    /* The expiry has been consumed, so the next conn_arm_timer must
+     * set the timerfd again even if it wants the same instant */
+    wk->utiming = 0;
+    wk->tfd_armed = 0;
+    break;
+
+  case UOP_POLL_ERR:
+    /* If stderr has an error, the tester has probably died, so exit
+     * immediately. */
+    if (res > 0 && (res & (POLLERR|POLLHUP)))
+      exit (1);
+    wk->upolled[1] = res < 0;	/* not pollable: don't ask again */
+    break;
   }
-
-  r = xmalloc (n * sizeof (*r));
-  memset (r, 0, n * sizeof (*r));
-  w = xmalloc (n * sizeof (*w));
-  memset (w, 0, n * sizeof (*w));
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll > 0)
-      r[c->rpoll] = c;
-    if (c->npoll > 0)
-      r[c->npoll] = c;
-    if (c->wpoll > 0)
-      w[c->wpoll] = c;
-  }
-
-  free (cevents);
-  cevents = e;
-  ncevents = n;
-  free (evreaders);
-  evreaders = r;
-  free (evwriters);
-  evwriters = w;
 }
 
+/* The io_uring counterpart of poll in conn_poll: posts whatever each
+ * connection needs, submits it all with one io_uring_enter that also
+ * waits for completions, and dispatches them. */
 static void
-conn_demux (const struct config_server *cs)
+conn_uring_poll (const struct config_common *cc)
 {
-  packet_t pkt;
-  struct sockaddr_storage ss;
-  int n;
+  struct io_uring_cqe *cqe;
+  struct uop *op;
+  conn_t *c;
+  int res;
+  long timeout;
 
-  memset (&ss, 0, sizeof (ss));
-  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
-    rel_demux (&cs->c, &ss, &pkt, n);
-    memset (&pkt, 0xc7, n);	     /* to help debugging */
-    memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
+  wk->cevents[0].revents = 0;
+  if (wk->serverconf) {
+    while (wk->urecvmsgs < UR_NRECVMSG && conn_uring_recvmsg (-1) == 0)
+      ;
+  }
+  else if (wk->cevents[0].fd >= 0 && !wk->upolled[0]) {
+    wk->upoll[0].kind = UOP_POLL_LISTEN;
+    if (conn_uring_prep (&wk->upoll[0], IORING_OP_POLL_ADD,
+			 wk->cevents[0].fd, NULL, 0, POLLIN))
+      wk->upolled[0] = 1;
+  }
+  if (!wk->upolled[1]) {
+    wk->upoll[1].kind = UOP_POLL_ERR;
+    if (conn_uring_prep (&wk->upoll[1], IORING_OP_POLL_ADD, 2, NULL, 0, 0))
+      wk->upolled[1] = 1;
   }
-  if (errno != EAGAIN)
-    perror ("UDP recv");
-}
 
-long
-need_timer_in (const struct timespec *last, long timer)
-{
-  long to;
-  struct timespec ts;
+  for (c = wk->conn_list; c; c = c->next) {
+    if (c->delete_me)
+      continue;
+    if (!c->server)
+      while (c->urecvs < UR_NRECV && conn_uring_recv (c, -1) == 0)
+	;
+    if (c->inmap && !c->read_eof)
+      rel_read (c->rel);
+    else if (!c->read_eof && c->inbuf_off == c->inbuf_len)
+      conn_uring_read (c);
+    conn_uring_write (c);
+  }
 
-  clock_gettime (CLOCK_MONOTONIC, &ts);
-  to = ts.tv_sec - last->tv_sec;
-  if (to > timer / 1000)
-    return 0;
-  to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (to >= timer)
-    return 0;
-  return
-    timer - to;
+  if (wk->tfd >= 0 && !wk->utiming) {
+    wk->utimer.kind = UOP_TIMER;
+    if (conn_uring_prep (&wk->utimer, IORING_OP_READ, wk->tfd,
+			 &wk->uticks, sizeof (wk->uticks), POLLIN))
+      wk->utiming = 1;
+  }
+
+  timeout = conn_arm_timer (cc);
+  worker_unlock ();
+  uring_submit_wait (wk->ring, 1, timeout);
+  worker_lock ();
+  now_ns_refresh ();
+
+  while ((cqe = uring_peek_cqe (wk->ring))) {
+    op = (struct uop *) (uintptr_t) cqe->user_data;
+    res = cqe->res;
+    uring_cqe_seen (wk->ring);
+    if (op && !((uintptr_t) op & 1))
+      conn_uring_complete (op, res, cc);
+  }
 }
 
 void
 conn_poll (const struct config_common *cc)
 {
   //int n, i;
-  int  i;
+  int  i, tick;
   conn_t *c, *nc;
-  static int last_cg;
+  uint64_t ticks;
 
-  if (last_cg != cevents_generation) {
+  if (wk->last_cg != wk->cevents_generation) {
     conn_mkevents ();
-    cevents_generation = last_cg;
+    wk->last_cg = wk->cevents_generation;
   }
 
-  if (cevents[0].fd >= 0)
-    poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
-  else
-    poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
+  /* Both backends sample the clock once they wake up, and callbacks
+   * run from this iteration share that time */
+  if (wk->ring)
+    conn_uring_poll (cc);
+  else {
+    long timeout = conn_arm_timer (cc);
+    worker_unlock ();
+    if (wk->cevents[0].fd >= 0)
+      poll (wk->cevents, wk->ncevents, timeout);
+    else
+      poll (wk->cevents+1, wk->ncevents-1, timeout);
+    worker_lock ();
+    now_ns_refresh ();
+  }
+  rlib_pass++;
 
-  for (i = 1; i < ncevents; i++) {
-    if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-      if ((c = evreaders[i]) && !c->delete_me) {
-	if (cevents[i].fd == c->rfd) {
+  if (wk->cevents[2].revents & POLLIN) {
+    read (wk->tfd, &ticks, sizeof (ticks));
+    wk->tfd_armed = 0;
+  }
+
+  /* Whichever loop SIGHUP interrupted re-reads the limits, and every
+   * worker picks them up when it next wakes */
+  if (rate_reload && __atomic_exchange_n (&rate_reload, 0, __ATOMIC_SEQ_CST))
+    read_rate_file ();
+  /* Likewise SIGUSR1 asks for the memory statistics */
+  if (stats_request
+      && __atomic_exchange_n (&stats_request, 0, __ATOMIC_SEQ_CST))
+    stats_dump (stderr);
+  if (wk->rate_gen != __atomic_load_n (&rate_generation, __ATOMIC_ACQUIRE))
+    conn_apply_rates ();
+
+  for (i = 1; i < wk->ncevents; i++) {
+    if (wk->cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
+      if ((c = wk->evreaders[i]) && !c->delete_me) {
+	if (c->inq && wk->cevents[i].fd == c->efd)
+	  conn_io_ready (c);
+	else if (wk->cevents[i].fd == c->rfd) {
 	  c->xoff = 1;
-	  cevents[i].events &= ~POLLIN;
+	  wk->cevents[i].events &= ~POLLIN;
 	  rel_read (c->rel);
 	}
-	else if (cevents[i].fd == c->nfd
-		 && (cevents[i].revents & (POLLERR|POLLHUP))) {
-	  char addr[NI_MAXHOST] = "unknown";
-	  char port[NI_MAXSERV] = "unknown";
-	  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-		       addr, sizeof (addr), port, sizeof (port),
-		       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-	  fprintf (stderr, "[received ICMP port unreachable;"
-		   " assuming peer at %s:%s is dead]\n", addr, port);
-	  if (cc->single_connection)
-	    exit (1);
-	  rel_destroy (c->rel);
+	else if (wk->cevents[i].fd == c->nfd
+		 && (wk->cevents[i].revents & (POLLERR|POLLHUP))) {
+	  conn_peer_dead (c, cc);
 	}
-	else if (cevents[i].fd == c->nfd && !c->server) {
+	else if (wk->cevents[i].fd == c->nfd && !c->server) {
 	  packet_t pkt;
 	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
 	  if (len < 0) {
@@ -618,38 +2111,54 @@ conn_poll (const struct config_common *cc)
 	      perror ("recv");
 	  }
 	  else {
+	    if (trace_on ())
+	      conn_trace (c, TRACE_RECV, &pkt, len);
 	    rel_recvpkt (c->rel, &pkt, len);
 	    memset (&pkt, 0xc9, len); /* for debugging */
 	  }
 	}
       }
     }
-    if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-	&& evwriters[i])
-      conn_drain (evwriters[i]);
-    if (cevents[i].revents & (POLLHUP|POLLERR)) {
+    if ((wk->cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
+	&& wk->evwriters[i])
+      conn_drain (wk->evwriters[i]);
+    if (wk->cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
       fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
-	       getpid (), cevents[i].fd, cevents[i].revents);
+	       getpid (), wk->cevents[i].fd, wk->cevents[i].revents);
 #endif
       /* If stderr has an error, the tester has probably died, so exit
        * immediately. */
-      if (cevents[i].fd == 2)
+      if (wk->cevents[i].fd == 2)
 	exit (1);
-      cevents[i].fd = -1;
+      wk->cevents[i].fd = -1;
     }
-    cevents[i].revents = 0;
+    wk->cevents[i].revents = 0;
   }
 
-  if (need_timer_in (&last_timeout, cc->timer) == 0) {
+  if (wk->impair)
+    conn_impair_drain ();
+
+  /* rel_timer runs every cc->timer milliseconds, and also as soon as
+   * any deadline passed to request_timer_at is reached */
+  tick = rlib_now >= wk->last_timeout + cc->timer * 1000000ULL;
+  if (tick || (wk->deadline && rlib_now >= wk->deadline)) {
+    wk->deadline = 0;
     rel_timer ();
-    clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+    if (tick)
+      wk->last_timeout = rlib_now;
   }
 
-  for (c = conn_list; c; c = nc) {
+  for (c = wk->conn_list; c; c = nc) {
     nc = c->next;
-    if (c->delete_me && (c->write_err || !c->outq))
-      conn_free (c);
+    if (c->delete_me && (c->write_err || !c->outq)
+	&& (!c->outq_ring || !cbq_count (c->outq_ring))
+	&& (!wk->impair || !impair_holds (wk->impair, c))) {
+      if (!c->upending)
+	conn_free (c);
+      else if (!c->ucancel)
+	conn_uring_cancel (c);
+    }
   }
 }
 
@@ -826,8 +2335,11 @@ get_address (struct sockaddr_storage *ss, int local,
   return 0;
 }
 
-int
-listen_on (int dgram, struct sockaddr_storage *ss)
+/* Like listen_on, but with reuseport non-zero the socket is bound with
+ * SO_REUSEPORT, so more sockets can later be bound to the same port
+ * with reuseport_socket and the kernel spreads peers across them. */
+static int
+listen_on_reuse (int dgram, struct sockaddr_storage *ss, int reuseport)
 {
   int type = dgram ? SOCK_DGRAM : SOCK_STREAM;
   int s = socket (ss->ss_family, type, 0);
@@ -842,6 +2354,12 @@ listen_on (int dgram, struct sockaddr_storage *ss)
   }
   if (!dgram)
     setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+  if (reuseport
+      && setsockopt (s, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof (n)) < 0) {
+    perror ("SO_REUSEPORT");
+    close (s);
+    return -1;
+  }
   if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
     perror ("bind");
     close (s);
@@ -880,6 +2398,32 @@ listen_on (int dgram, struct sockaddr_storage *ss)
   return s;
 }
 
+int
+listen_on (int dgram, struct sockaddr_storage *ss)
+{
+  return listen_on_reuse (dgram, ss, 0);
+}
+
+/* Another UDP socket on a port already bound by listen_on_reuse. */
+static int
+reuseport_socket (const struct sockaddr_storage *ss)
+{
+  int s = socket (ss->ss_family, SOCK_DGRAM, 0);
+  int n = 1;
+
+  if (s < 0) {
+    perror ("socket");
+    return -1;
+  }
+  if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof (n)) < 0
+      || bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
+    perror ("bind");
+    close (s);
+    return -1;
+  }
+  return s;
+}
+
 int
 connect_to (int dgram, const struct sockaddr_storage *ss)
 {
@@ -912,6 +2456,8 @@ debug_recv (int s, packet_t *buf, size_t len, int flags,
     n = recv (s, buf, len, flags);
   if (opt_debug)
     print_pkt (buf, "recv", n);
+  if (from && n >= 0 && trace_on ())
+    trace_addr (from, TRACE_RECV, buf, n);
   return n;
 }
 
@@ -919,13 +2465,14 @@ debug_recv (int s, packet_t *buf, size_t len, int flags,
 void
 do_client (struct config_client *cc)
 {
+  worker_init ();
   conn_mkevents ();
   make_async (cc->listen_socket);
-  cevents[0].fd = cc->listen_socket;
-  cevents[0].events = POLLIN;
+  wk->cevents[0].fd = cc->listen_socket;
+  wk->cevents[0].events = POLLIN;
   for (;;) {
     conn_poll (&cc->c);
-    if (cevents[0].revents) {
+    if (wk->cevents[0].revents) {
       struct sockaddr_storage ss;
       socklen_t len = sizeof (ss);
       int s, u;
@@ -943,6 +2490,8 @@ do_client (struct config_client *cc)
 	c->wfd = s;
 	c->nfd = u;
 	c->peer = cc->server;
+	if (opt_pipeline)
+	  conn_start_io (c);
 	c->rel = rel_create (c, NULL, &cc->c);
 	conn_mkevents ();
       }
@@ -952,28 +2501,620 @@ do_client (struct config_client *cc)
   }
 }
 
-void
-do_server (struct config_server *cs)
+static void
+server_loop (struct config_server *cs)
 {
-  serverconf = cs;
+  wk->serverconf = cs;
+  worker_init ();
   conn_mkevents ();
   make_async (cs->udp_socket);
-  cevents[0].fd = cs->udp_socket;
-  cevents[0].events = POLLIN;
+  wk->cevents[0].fd = cs->udp_socket;
+  wk->cevents[0].events = POLLIN;
   for (;;) {
     conn_poll (&cs->c);
-    if (cevents[0].revents)
+    if (wk->cevents[0].revents)
       conn_demux (cs);
   }
 }
 
+static void *
+worker_thread (void *_w)
+{
+  wk = _w;
+  server_loop (wk->serverconf);
+  return NULL;
+}
+
+/* Runs the server on cs->nworkers threads.  Each extra worker gets a
+ * copy of the configuration with its own SO_REUSEPORT socket, and
+ * since the kernel hashes a peer's address to pick the socket, all of
+ * a client's packets land on the same worker. */
+void
+do_server (struct config_server *cs)
+{
+  int i;
+
+  for (i = 1; i < cs->nworkers; i++) {
+    struct worker *w = xmalloc (sizeof (*w));
+    memset (w, 0, sizeof (*w));
+    w->serverconf = xmalloc (sizeof (*w->serverconf));
+    *w->serverconf = *cs;
+    if ((w->serverconf->udp_socket = reuseport_socket (&cs->local)) < 0)
+      exit (1);
+    if ((errno = pthread_create (&w->thread, NULL, worker_thread, w))) {
+      perror ("pthread_create");
+      exit (1);
+    }
+  }
+  server_loop (cs);
+}
+
+/* The control socket (-C) answers one request per connection with
+ * statistics for the whole process and each of its connections.  The
+ * request is a line: "json" (the default, for an empty line too),
+ * "prometheus" for the Prometheus text format, or an HTTP GET, which
+ * gets Prometheus text unless the path mentions json, so
+ * curl --unix-socket works too. */
+
+/* The latency histograms are reported as these percentiles */
+static const double lat_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define NLAT_QUANTILES (sizeof (lat_quantiles) / sizeof (lat_quantiles[0]))
+
+static const struct lat_field {
+  const char *name;
+  const char *help;
+  size_t off;			/* into struct rel_hists */
+} lat_fields[] = {
+  { "rtt_us", "Round trip time of packets sent once, in microseconds",
+    offsetof (struct rel_hists, rtt) },
+  { "delivery_us", "Time from reading data to the ack saying it was"
+    " delivered, in microseconds", offsetof (struct rel_hists, delivery) },
+  { "recv_wait_us", "Time packets waited to be delivered, in microseconds",
+    offsetof (struct rel_hists, recv_wait) },
+};
+#define NLAT_FIELDS (sizeof (lat_fields) / sizeof (lat_fields[0]))
+
+/* What a histogram is reported as */
+struct lat_summary {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t max;
+  uint32_t q[NLAT_QUANTILES];
+};
+
+static void
+lat_summarize (const struct rel_hists *h, struct lat_summary *sum)
+{
+  int i, j;
+
+  for (i = 0; i < NLAT_FIELDS; i++) {
+    const hist_t *hi = (const hist_t *) ((const char *) h + lat_fields[i].off);
+    sum[i].count = hi->count;
+    sum[i].sum = hi->sum;
+    sum[i].max = hi->max;
+    for (j = 0; j < NLAT_QUANTILES; j++)
+      sum[i].q[j] = hist_percentile (hi, lat_quantiles[j]);
+  }
+}
+
+/* Bytes the -l logs have dropped */
+static uint64_t
+log_dropped (void)
+{
+  uint64_t n;
+
+  pthread_rwlock_rdlock (&log_lock);
+  n = (log_in ? logger_dropped (log_in) : 0)
+    + (log_out ? logger_dropped (log_out) : 0);
+  pthread_rwlock_unlock (&log_lock);
+  return n;
+}
+
+/* What the control thread copies out of one connection */
+struct conn_snap {
+  struct rel_stats rs;
+  struct lat_summary lat[NLAT_FIELDS];
+  int worker;
+  char peer[NI_MAXHOST + NI_MAXSERV + 1];
+  uint64_t outq;		/* output bytes not yet written */
+};
+
+static const struct stat_field {
+  const char *name;
+  const char *help;
+  size_t off;			/* into struct rel_stats */
+  char counter;			/* only goes up, and adds over connections */
+} stat_fields[] = {
+#define F(name, field, counter, help) \
+  { name, help, offsetof (struct rel_stats, field), counter }
+  F ("packets_sent", pkts_sent, 1,
+     "Data packets sent, retransmissions included"),
+  F ("bytes_sent", bytes_sent, 1, "Bytes of data packets sent"),
+  F ("retransmits", retransmits, 1, "Data packets sent more than once"),
+  F ("acks_sent", acks_sent, 1, "Ack packets sent"),
+  F ("packets_received", pkts_recv, 1,
+     "Valid packets received, acks included"),
+  F ("bytes_received", bytes_recv, 1, "Bytes of valid packets received"),
+  F ("duplicates", dups, 1, "Data packets received that we already had"),
+  F ("checksum_failures", bad, 1,
+     "Packets dropped for a bad checksum or length"),
+  F ("bytes_delivered", bytes_delivered, 1,
+     "Payload bytes written to the output"),
+  F ("send_queue", send_queued, 0, "Packets read but not yet acked"),
+  F ("in_flight", in_flight, 0, "Packets sent but not yet acked"),
+  F ("recv_queue", recv_queued, 0, "Packets waiting to be delivered"),
+  F ("window", window, 0, "Send window in packets"),
+  F ("rto_ms", rto_ms, 0, "Retransmission timeout in milliseconds"),
+  F ("srtt_ns", srtt_ns, 0,
+     "Smoothed round trip time in nanoseconds, 0 if unknown"),
+#undef F
+};
+#define NSTAT_FIELDS (sizeof (stat_fields) / sizeof (stat_fields[0]))
+/* The first NSTAT_TOTALS add up over connections; the rest only mean
+ * something for one */
+#define NSTAT_TOTALS 12
+
+static uint64_t
+stat_get (const struct rel_stats *rs, int i)
+{
+  return *(const uint64_t *) ((const char *) rs + stat_fields[i].off);
+}
+
+/* Payload bytes delivered per second, over age nanoseconds */
+static uint64_t
+goodput (uint64_t bytes, uint64_t age)
+{
+  return age ? (uint64_t) (bytes * 1e9 / age) : 0;
+}
+
+static void
+peer_name (const struct sockaddr_storage *ss, char *buf, size_t len)
+{
+  char host[NI_MAXHOST], port[NI_MAXSERV];
+
+  if (ss->ss_family == AF_UNIX)
+    snprintf (buf, len, "%s", ((const struct sockaddr_un *) ss)->sun_path);
+  else if (getnameinfo ((const struct sockaddr *) ss, addrsize (ss),
+			host, sizeof (host), port, sizeof (port),
+			NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV))
+    snprintf (buf, len, "unknown");
+  else
+    snprintf (buf, len, "%s:%s", host, port);
+}
+
+/* Escapes s->peer in place for a JSON string, or for a Prometheus
+ * label value if prom is set, cutting it short if it no longer fits.
+ * Addresses never need it, but a Unix socket path can hold anything. */
+static void
+peer_escape (struct conn_snap *s, int prom)
+{
+  char in[sizeof (s->peer)], *out = s->peer;
+  const char *p;
+  size_t n = 0, max = sizeof (s->peer) - 1;
+
+  memcpy (in, s->peer, sizeof (in));
+  for (p = in; *p; p++) {
+    unsigned char ch = *p;
+    char esc[7];
+    size_t e;
+
+    if (ch == '"' || ch == '\\')
+      e = snprintf (esc, sizeof (esc), "\\%c", ch);
+    else if (ch == '\n')
+      e = snprintf (esc, sizeof (esc), "\\n");
+    else if (ch < 0x20 && !prom)
+      e = snprintf (esc, sizeof (esc), "\\u%04x", ch);
+    else
+      e = snprintf (esc, sizeof (esc), "%c", ch);
+    if (n + e > max)
+      break;
+    memcpy (out + n, esc, e);
+    n += e;
+  }
+  out[n] = '\0';
+}
+
+/* Copies out every live connection, holding each worker still in turn,
+ * and adds their histograms to hists.  Returns how many there are, with
+ * the copies in *snapp. */
+static int
+control_snapshot (struct conn_snap **snapp, struct rel_hists *hists)
+{
+  static struct rel_hists h;	/* only the control thread uses it */
+  struct conn_snap *snap = NULL, *s;
+  int n = 0, max = 0;
+  struct worker *w;
+  conn_t *c;
+  chunk_t *ch;
+
+  pthread_mutex_lock (&worker_list_lock);
+  for (w = worker_list; w; w = w->wnext) {
+    __atomic_add_fetch (&w->snap_waiting, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock (&w->lock);
+    __atomic_sub_fetch (&w->snap_waiting, 1, __ATOMIC_RELEASE);
+    for (c = w->conn_list; c; c = c->next) {
+      if (c->delete_me || !c->rel)
+	continue;
+      if (n == max) {
+	max = max ? 2 * max : 64;
+	if (!(snap = realloc (snap, max * sizeof (*snap)))) {
+	  fprintf (stderr, "%s: out of memory\n", progname);
+	  abort ();
+	}
+      }
+      s = &snap[n++];
+      rel_stats (c->rel, &s->rs);
+      memset (&h, 0, sizeof (h));
+      rel_hists (c->rel, &h);
+      lat_summarize (&h, s->lat);
+      hist_add (&hists->rtt, &h.rtt);
+      hist_add (&hists->delivery, &h.delivery);
+      hist_add (&hists->recv_wait, &h.recv_wait);
+      s->worker = w->id;
+      peer_name (&c->peer, s->peer, sizeof (s->peer));
+      s->outq = __atomic_load_n (&c->outq_bytes, __ATOMIC_RELAXED);
+      for (ch = c->outq; ch; ch = ch->next)
+	s->outq += ch->size - ch->used;
+    }
+    pthread_cond_signal (&w->handoff);
+    pthread_mutex_unlock (&w->lock);
+  }
+  pthread_mutex_unlock (&worker_list_lock);
+
+  *snapp = snap;
+  return n;
+}
+
+static void
+lat_json (FILE *f, const struct lat_summary *lat)
+{
+  int i, j;
+
+  for (i = 0; i < NLAT_FIELDS; i++) {
+    fprintf (f, "%s\"%s\":{\"count\":%llu,\"mean\":%llu", i ? "," : "",
+	     lat_fields[i].name, (unsigned long long) lat[i].count,
+	     (unsigned long long) (lat[i].count ? lat[i].sum / lat[i].count
+				   : 0));
+    for (j = 0; j < NLAT_QUANTILES; j++)
+      fprintf (f, ",\"p%g\":%u", lat_quantiles[j] * 100, lat[i].q[j]);
+    fprintf (f, ",\"max\":%u}", lat[i].max);
+  }
+}
+
+static void
+control_json (FILE *f, const struct rel_stats *tot, uint64_t outq,
+	      const struct lat_summary *lat, uint64_t now,
+	      const struct conn_snap *snap, int n)
+{
+  int i, k;
+
+  fprintf (f, "{\"uptime_ns\":%llu,\"connections\":%d,\"totals\":{",
+	   (unsigned long long) (now - started_ns), n);
+  for (i = 0; i < NSTAT_TOTALS; i++)
+    fprintf (f, "\"%s\":%llu,", stat_fields[i].name,
+	     (unsigned long long) stat_get (tot, i));
+  fprintf (f, "\"out_queue_bytes\":%llu,\"goodput_bps\":%llu},\"latency\":{",
+	   (unsigned long long) outq,
+	   (unsigned long long) goodput (tot->bytes_delivered,
+					 now - started_ns));
+  lat_json (f, lat);
+  fprintf (f, "},\"memory\":{");
+  for (k = 0; k < MEM_KINDS; k++)
+    fprintf (f, "%s\"%s\":%ld", k ? "," : "", mem_kind_name (k),
+	     mem_total (k));
+  fprintf (f, "},\"log_dropped_bytes\":%llu,\"conns\":[",
+	   (unsigned long long) log_dropped ());
+  for (k = 0; k < n; k++) {
+    const struct conn_snap *s = &snap[k];
+    fprintf (f, "%s{\"worker\":%d,\"peer\":\"%s\",\"age_ns\":%llu",
+	     k ? "," : "", s->worker, s->peer,
+	     (unsigned long long) (now - s->rs.start_ns));
+    for (i = 0; i < NSTAT_FIELDS; i++)
+      fprintf (f, ",\"%s\":%llu", stat_fields[i].name,
+	       (unsigned long long) stat_get (&s->rs, i));
+    fprintf (f, ",\"out_queue_bytes\":%llu,\"goodput_bps\":%llu,"
+	     "\"latency\":{", (unsigned long long) s->outq,
+	     (unsigned long long) goodput (s->rs.bytes_delivered,
+					   now - s->rs.start_ns));
+    lat_json (f, s->lat);
+    fprintf (f, "}}");
+  }
+  fprintf (f, "]}\n");
+}
+
+static void
+prom_head (FILE *f, const char *name, const char *suffix, const char *type,
+	   const char *help)
+{
+  fprintf (f, "# HELP reliable_%s%s %s.\n# TYPE reliable_%s%s %s\n",
+	   name, suffix, help, name, suffix, type);
+}
+
+/* A Prometheus summary for one histogram, labels being the labels for
+ * it (if any) followed by a comma */
+static void
+lat_prometheus (FILE *f, const char *name, const char *labels,
+		const struct lat_summary *lat)
+{
+  int j;
+
+  for (j = 0; j < NLAT_QUANTILES; j++)
+    fprintf (f, "reliable_%s{%squantile=\"%g\"} %u\n", name, labels,
+	     lat_quantiles[j], lat->q[j]);
+  if (*labels) {
+    /* drop the trailing comma for the other two */
+    int len = strlen (labels) - 1;
+    fprintf (f, "reliable_%s_sum{%.*s} %llu\nreliable_%s_count{%.*s} %llu\n",
+	     name, len, labels, (unsigned long long) lat->sum,
+	     name, len, labels, (unsigned long long) lat->count);
+  }
+  else
+    fprintf (f, "reliable_%s_sum %llu\nreliable_%s_count %llu\n",
+	     name, (unsigned long long) lat->sum,
+	     name, (unsigned long long) lat->count);
+}
+
+static void
+control_prometheus (FILE *f, const struct rel_stats *tot, uint64_t outq,
+		    const struct lat_summary *lat, uint64_t now,
+		    const struct conn_snap *snap, int n)
+{
+  char name[64], labels[NI_MAXHOST + NI_MAXSERV + 40];
+  int i, k;
+
+  prom_head (f, "connections", "", "gauge", "Open connections");
+  fprintf (f, "reliable_connections %d\n", n);
+  for (i = 0; i < NSTAT_TOTALS; i++) {
+    const char *suffix = stat_fields[i].counter ? "_total" : "";
+    prom_head (f, stat_fields[i].name, suffix,
+	       stat_fields[i].counter ? "counter" : "gauge",
+	       stat_fields[i].help);
+    fprintf (f, "reliable_%s%s %llu\n", stat_fields[i].name, suffix,
+	     (unsigned long long) stat_get (tot, i));
+  }
+  prom_head (f, "out_queue_bytes", "", "gauge",
+	     "Output bytes waiting to be written");
+  fprintf (f, "reliable_out_queue_bytes %llu\n", (unsigned long long) outq);
+  prom_head (f, "goodput_bps", "", "gauge",
+	     "Payload bytes delivered per second since startup");
+  fprintf (f, "reliable_goodput_bps %llu\n",
+	   (unsigned long long) goodput (tot->bytes_delivered,
+					 now - started_ns));
+  for (i = 0; i < NLAT_FIELDS; i++) {
+    prom_head (f, lat_fields[i].name, "", "summary", lat_fields[i].help);
+    lat_prometheus (f, lat_fields[i].name, "", &lat[i]);
+  }
+  prom_head (f, "memory_bytes", "", "gauge", "Bytes held, by kind");
+  for (k = 0; k < MEM_KINDS; k++)
+    fprintf (f, "reliable_memory_bytes{kind=\"%s\"} %ld\n",
+	     mem_kind_name (k), mem_total (k));
+  prom_head (f, "log_dropped_bytes", "_total", "counter",
+	     "Traffic log bytes dropped because the disk was behind");
+  fprintf (f, "reliable_log_dropped_bytes_total %llu\n",
+	   (unsigned long long) log_dropped ());
+
+  /* Then everything again for each connection */
+  for (i = 0; i < NSTAT_FIELDS; i++) {
+    const char *suffix = stat_fields[i].counter ? "_total" : "";
+    snprintf (name, sizeof (name), "conn_%s", stat_fields[i].name);
+    prom_head (f, name, suffix, stat_fields[i].counter ? "counter" : "gauge",
+	       stat_fields[i].help);
+    for (k = 0; k < n; k++)
+      fprintf (f, "reliable_%s%s{worker=\"%d\",peer=\"%s\"} %llu\n",
+	       name, suffix, snap[k].worker, snap[k].peer,
+	       (unsigned long long) stat_get (&snap[k].rs, i));
+  }
+  prom_head (f, "conn_", "out_queue_bytes", "gauge",
+	     "Output bytes waiting to be written");
+  for (k = 0; k < n; k++)
+    fprintf (f, "reliable_conn_out_queue_bytes{worker=\"%d\",peer=\"%s\"}"
+	     " %llu\n", snap[k].worker, snap[k].peer,
+	     (unsigned long long) snap[k].outq);
+  prom_head (f, "conn_", "goodput_bps", "gauge",
+	     "Payload bytes delivered per second since the connection began");
+  for (k = 0; k < n; k++)
+    fprintf (f, "reliable_conn_goodput_bps{worker=\"%d\",peer=\"%s\"} %llu\n",
+	     snap[k].worker, snap[k].peer,
+	     (unsigned long long) goodput (snap[k].rs.bytes_delivered,
+					   now - snap[k].rs.start_ns));
+  for (i = 0; i < NLAT_FIELDS; i++) {
+    snprintf (name, sizeof (name), "conn_%s", lat_fields[i].name);
+    prom_head (f, name, "", "summary", lat_fields[i].help);
+    for (k = 0; k < n; k++) {
+      snprintf (labels, sizeof (labels), "worker=\"%d\",peer=\"%s\",",
+		snap[k].worker, snap[k].peer);
+      lat_prometheus (f, name, labels, &snap[k].lat[i]);
+    }
+  }
+}
+
+/* Writes statistics for the whole process, closed connections
+ * included, and each live connection to f, as Prometheus text if prom
+ * is set and JSON if not */
+static void
+control_report (FILE *f, int prom)
+{
+  struct conn_snap *snap;
+  struct rel_stats tot;
+  static struct rel_hists hists;
+  struct lat_summary lat[NLAT_FIELDS];
+  uint64_t outq = 0, now;
+  int n, i, k;
+
+  memset (&hists, 0, sizeof (hists));
+  n = control_snapshot (&snap, &hists);
+  now = now_ns_refresh ();
+  memset (&tot, 0, sizeof (tot));
+  rel_stats_closed (&tot);
+  rel_hists_closed (&hists);
+  lat_summarize (&hists, lat);
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < NSTAT_TOTALS; i++)
+      *(uint64_t *) ((char *) &tot + stat_fields[i].off)
+	+= stat_get (&snap[k].rs, i);
+    outq += snap[k].outq;
+    peer_escape (&snap[k], prom);
+  }
+
+  if (prom)
+    control_prometheus (f, &tot, outq, lat, now, snap, n);
+  else
+    control_json (f, &tot, outq, lat, now, snap, n);
+  free (snap);
+}
+
+/* Answers one request on s */
+static void
+control_serve (int s)
+{
+  char req[256], *out = NULL;
+  size_t len = 0, done;
+  struct timeval tv = { 1, 0 };
+  int prom, http;
+  ssize_t r;
+  FILE *f;
+
+  /* Don't let a silent client hold us up for long */
+  setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  r = recv (s, req, sizeof (req) - 1, 0);
+  req[r > 0 ? r : 0] = '\0';
+  http = !strncmp (req, "GET ", 4);
+  prom = http ? !strstr (req, "json") : !strncmp (req, "prometheus", 10);
+
+  if (!(f = open_memstream (&out, &len)))
+    return;
+  control_report (f, prom);
+  fclose (f);
+
+  if (http) {
+    char hdr[160];
+    int hlen = snprintf (hdr, sizeof (hdr), "HTTP/1.0 200 OK\r\n"
+			 "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+			 prom ? "text/plain; version=0.0.4"
+			 : "application/json", len);
+    send (s, hdr, hlen, MSG_NOSIGNAL);
+  }
+  for (done = 0; done < len; done += r)
+    if ((r = send (s, out + done, len - done, MSG_NOSIGNAL)) <= 0)
+      break;
+  free (out);
+}
+
+static void *
+control_thread (void *arg)
+{
+  int ls = (intptr_t) arg, s;
+
+  for (;;) {
+    if ((s = accept (ls, NULL, NULL)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED)
+	perror ("accept");
+      continue;
+    }
+    control_serve (s);
+    close (s);
+  }
+  return NULL;
+}
+
+/* Starts the control thread listening on the unix socket path */
+static void
+control_start (char *path)
+{
+  struct sockaddr_storage ss;
+  pthread_t t;
+  int s;
+
+  if (get_address (&ss, 1, 0, AF_UNIX, path) < 0
+      || (s = listen_on (0, &ss)) < 0)
+    exit (1);
+  started_ns = now_ns_refresh ();
+  if ((errno = pthread_create (&t, NULL, control_thread,
+			       (void *) (intptr_t) s))) {
+    perror ("pthread_create");
+    exit (1);
+  }
+  pthread_detach (t);
+}
+
+/* Writes the control socket's JSON to the -S file, once the single
+ * connection is over */
+static void
+stats_write (void)
+{
+  FILE *f;
+
+  worker_unlock ();
+  if (!(f = fopen (opt_stats, "w"))) {
+    perror (opt_stats);
+    return;
+  }
+  control_report (f, 0);
+  if (fclose (f))
+    perror (opt_stats);
+}
+
+/* Writes out what the -l logs still have buffered, at exit */
+static void
+log_close (void)
+{
+  logger_t *lg[2];
+  int i;
+
+  /* Take the loggers away first, so that no other thread can still be
+   * writing to one, or reading its drop count, once it's closed */
+  pthread_rwlock_wrlock (&log_lock);
+  lg[0] = log_in;
+  lg[1] = log_out;
+  __atomic_store_n (&log_in, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n (&log_out, NULL, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock (&log_lock);
+
+  for (i = 0; i < 2; i++)
+    if (lg[i]) {
+      uint64_t dropped = logger_dropped (lg[i]);
+      logger_close (lg[i]);
+      if (dropped)
+	fprintf (stderr, "%s: %llu bytes of %s log dropped\n", progname,
+		 (unsigned long long) dropped, i ? "output" : "input");
+    }
+}
+
+/* Hands the -l log files to loggers, which keep writing them from
+ * threads of their own */
+static void
+log_start (int in, int out)
+{
+  if ((in >= 0 && !(log_in = logger_open (in, opt_log_drop)))
+      || (out >= 0 && !(log_out = logger_open (out, opt_log_drop)))) {
+    perror ("logger");
+    exit (1);
+  }
+  atexit (log_close);
+}
+
 static void
 usage (void)
 {
   fprintf (stderr,
-	   "usage: %s udp-port [host:]udp-port\n"
-	   "       %s -c {-u unix-socket | tcp-port} [host:]udp-port\n"
-	   "       %s -s [-u] udp-port {unix-socket | [host:]tcp-port}\n"
+	   "usage: %s [-P | -U] [-R[rate]] udp-port [host:]udp-port\n"
+	   "       %s -c [-P | -U] [-R[rate]] {-u unix-socket | tcp-port}"
+	   " [host:]udp-port\n"
+	   "       %s -s [-u] [-U] [-R[rate]] [-n workers] udp-port"
+	   " {unix-socket | [host:]tcp-port}\n"
+	   "rate limits, in any mode:"
+	   " [-L conn-rate] [-G global-rate] [-F rate-file]\n"
+	   "huge page arenas for connection state, in any mode: [-H]\n"
+	   "statistics on a control socket, in any mode: [-C unix-socket]\n"
+	   "statistics written to a file when the connection ends,"
+	   " without -c or -s: [-S file]\n"
+	   "packet trace, dumped on SIGUSR2 or a crash, in any mode:"
+	   " [-T file[.pcap]]\n"
+	   "traffic logs, dropping data when the disk can't keep up with -D,"
+	   " in any mode: [-l [-D]]\n"
+	   "network impairment, in any mode (see impair.h):"
+	   " [-I loss=%%,delay=ms,...] [-e seed]\n"
 	   , progname, progname, progname);
   exit (1);
 }
@@ -992,12 +3133,28 @@ main (int argc, char **argv)
     { "server", no_argument, NULL, 's' },
     { "window", required_argument, NULL, 'w' },
     { "client", no_argument, NULL, 'c' },
+    { "workers", required_argument, NULL, 'n' },
+    { "pipeline", no_argument, NULL, 'P' },
+    { "io-uring", no_argument, NULL, 'U' },
+    { "pace", optional_argument, NULL, 'R' },
+    { "rate", required_argument, NULL, 'L' },
+    { "global-rate", required_argument, NULL, 'G' },
+    { "rate-file", required_argument, NULL, 'F' },
+    { "hugepages", no_argument, NULL, 'H' },
+    { "control", required_argument, NULL, 'C' },
+    { "stats", required_argument, NULL, 'S' },
+    { "trace", required_argument, NULL, 'T' },
+    { "log-drop", no_argument, NULL, 'D' },
+    { "impair", required_argument, NULL, 'I' },
     { NULL, 0, NULL, 0 }
   };
   int opt;
   int opt_unix = 0;
   int opt_client = 0;
   int opt_server = 0;
+  int opt_workers = 1;
+  int log_in_fd = -1;
+  int log_out_fd = -1;
   char *local = NULL;
   char *remote = NULL;
   struct config_common c;
@@ -1009,6 +3166,10 @@ main (int argc, char **argv)
   sa.sa_handler = SIG_IGN;
   sigaction (SIGPIPE, &sa, NULL);
 
+  /* Dump memory statistics on SIGUSR1 */
+  sa.sa_handler = stats_sigusr1;
+  sigaction (SIGUSR1, &sa, NULL);
+
   memset (&c, 0, sizeof (c));
   c.window = 1;
   c.timeout = 2000;
@@ -1019,38 +3180,50 @@ main (int argc, char **argv)
   else
     progname = argv[0];
 
-  while ((opt = getopt_long (argc, argv, "cdust:r:p:y:q:e:w:l", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "cdust:r:p:y:q:e:w:ln:PUR::L:G:F:HC:S:T:DI:", o, NULL)) != -1)
     switch (opt) {
     case 'c':
       opt_client = 1;
       break;
     case 'd':
       opt_debug = 1;
+      debug_pid = getpid ();
       break;
     case 'e':
-      srand(atoi(optarg));
+      impair_conf.seed = strtoull (optarg, NULL, 0);
+      break;
     case 'r':
-      opt_drop = atoi(optarg);
+      impair_conf.loss = atoi (optarg) / 100.0;
       break;
     case 'p':
-      opt_corrupt = atoi(optarg);
+      impair_conf.corrupt = atoi (optarg) / 100.0;
       break;
     case 'y':
-      opt_delay = atoi(optarg);
+      /* The old fork-based delay: that many percent of packets held
+       * back for up to five seconds */
+      impair_conf.delay = impair_conf.jitter = 2500000000ULL;
+      impair_conf.dist = IMPAIR_UNIFORM;
+      impair_conf.reorder = 1 - atoi (optarg) / 100.0;
       break;
     case 'q':
-      opt_duplicate = atoi(optarg);
+      impair_conf.dup = atoi (optarg) / 100.0;
+      break;
+    case 'I':
+      if (impair_parse (&impair_conf, optarg) < 0) {
+	fprintf (stderr, "%s: bad impairment: %s\n", progname, optarg);
+	usage ();
+      }
       break;
     case 'l':
       {
 	char name[40];
 	snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
-	log_in = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-	if (log_in < 0)
+	log_in_fd = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+	if (log_in_fd < 0)
 	  perror (name);
 	snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
-	log_out = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-	if (log_out < 0)
+	log_out_fd = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+	if (log_out_fd < 0)
 	  perror (name);
       }
       break;
@@ -1066,26 +3239,90 @@ main (int argc, char **argv)
     case 't':
       c.timeout = atoi (optarg);
       break;
+    case 'n':
+      opt_workers = atoi (optarg);
+      break;
+    case 'P':
+      opt_pipeline = 1;
+      break;
+    case 'U':
+      opt_uring = 1;
+      break;
+    case 'R':
+      c.pace = optarg ? atol (optarg) : -1;
+      break;
+    case 'L':
+      opt_conn_rate = strtoull (optarg, NULL, 0);
+      break;
+    case 'G':
+      opt_global_rate = strtoull (optarg, NULL, 0);
+      break;
+    case 'F':
+      opt_rate_file = optarg;
+      break;
+    case 'H':
+      pool_use_hugepages ();
+      break;
+    case 'C':
+      opt_control = optarg;
+      break;
+    case 'S':
+      opt_stats = optarg;
+      break;
+    case 'D':
+      opt_log_drop = 1;
+      break;
+    case 'T':
+      if (trace_open (optarg, TRACE_ENTRIES) < 0) {
+	perror ("trace");
+	exit (1);
+      }
+      break;
     default:
       usage ();
       break;
     }
 
   if (optind + 2 != argc || c.window < 1 || c.timeout < 10
-      || (opt_server && opt_client)
-      || (!(opt_server || opt_client) && opt_unix))
+      || c.pace < -1 || (opt_server && opt_client) || opt_workers < 1
+      || (opt_workers > 1 && !opt_server) || (opt_pipeline && opt_server)
+      || (opt_pipeline && opt_uring)
+      || (!(opt_server || opt_client) && opt_unix)
+      || (opt_stats && (opt_server || opt_client)))
     usage ();
   c.timer = c.timeout / 5;
+  c.latency = opt_control || opt_stats;
+
+  if (log_in_fd >= 0 || log_out_fd >= 0)
+    log_start (log_in_fd, log_out_fd);
+
+  if (opt_rate_file) {
+    read_rate_file ();
+    sa.sa_handler = rate_sighup;
+    sigaction (SIGHUP, &sa, NULL);
+  }
+  if (opt_stats)
+    started_ns = now_ns_refresh ();
+  if (opt_control)
+    control_start (opt_control);
+  if (opt_uring)
+    atexit (conn_uring_exit);
   local = argv[optind];
   remote = argv[optind+1];
 
   if (opt_server) {
     struct config_server cs;
     cs.c = c;
+    cs.nworkers = opt_workers;
+    rate_shares = opt_workers;
     if (get_address (&cs.dest, 0, 0, opt_unix ? AF_UNIX : AF_INET, remote) < 0
 	|| get_address (&ss, 1, 1, AF_INET, local) < 0
-	|| (cs.udp_socket = listen_on (1, &ss)) < 0)
+	|| (cs.udp_socket = listen_on_reuse (1, &ss, opt_workers > 1)) < 0)
       exit (1);
+    cs.local = ss;
+    if (ss.ss_family == AF_INET)
+      trace_local (((struct sockaddr_in *) &ss)->sin_addr.s_addr,
+		   ((struct sockaddr_in *) &ss)->sin_port);
     do_server (&cs);
   }
   else if (opt_client) {
@@ -1112,16 +3349,28 @@ main (int argc, char **argv)
       perror ("connect");
       exit (1);
     }
+    if (sl.ss_family == AF_INET)
+      trace_local (((struct sockaddr_in *) &sl)->sin_addr.s_addr,
+		   ((struct sockaddr_in *) &sl)->sin_port);
     cn->server = 0;
     cn->peer = sr;
     make_async (cn->rfd);
     make_async (cn->wfd);
     make_async (cn->nfd);
+    if (opt_pipeline)
+      conn_start_io (cn);
+    else {
+      conn_map_input (cn);
+      conn_sink_output (cn);
+    }
+    worker_init ();
     cn->rel = rel_create (cn, NULL, &c);
 
     conn_mkevents ();
-    while (conn_list)
+    while (wk->conn_list)
       conn_poll (&c);
+    if (opt_stats)
+      stats_write ();
   }
 
   return 0;
@@ -5,6 +5,9 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "hist.h"
+#include "trace.h"
+
 /* -----------------------------------------------------------------------
 
    Simple reliable sliding window protocol.
@@ -109,6 +112,11 @@ typedef struct packet packet_t;
                   CLOCK_MONOTONIC useful for keeping track of when
                   packets are sent.  Run "man clock_gettime".
 
+       - pace:    If non-zero, data packets should be spread out in
+                  time rather than sent back-to-back: at pace bytes per
+                  second, or if pace is -1, at a rate that would send
+                  one window per measured round trip.
+
    * Your task is to implement the following seven functions:
 
        rel_create, rel_destroy, rel_recvpkt, rel_demux,
@@ -176,7 +184,9 @@ typedef struct packet packet_t;
      to inspect packets and retransmit packets that have not been
      acknowledged.  Do not retransmit every packet every time the
      timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+     retransmitted when.  To have rel_timer called at the moment a
+     retransmission falls due rather than at the next periodic call,
+     pass that time to request_timer_at.
 
 */
 
@@ -184,7 +194,9 @@ struct config_common {
   int window;			/* # of unacknowledged packets in flight */
   int timer;			/* How often rel_timer called in milliseconds */
   int timeout;			/* Retransmission timeout in milliseconds */
+  long pace;			/* Bytes/second, -1 for window/RTT, 0 off */
   int single_connection;        /* Exit after first connection failure */
+  int latency;			/* Keep latency histograms (see rel_hists) */
 };
 
 typedef struct reliable_state rel_t;
@@ -225,6 +237,11 @@ conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 /* Call this function to send a UDP packet to the other side. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
+/* Records event (TRACE_SEND and so on, see trace.h) for the n byte
+ * packet pkt, still in network byte order, in the packet trace.  Only
+ * worth calling when trace_on (), which is when rlib was run with -T. */
+void conn_trace (conn_t *c, int event, const packet_t *pkt, int n);
+
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
  * to return 0 if you write less than this many bytes. */
@@ -246,9 +263,67 @@ int conn_output (conn_t *c, const void *buf, size_t len);
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
- * data currently available, and -1 on EOF or error. */
+ * data currently available, and -1 on EOF or error.  Input is read
+ * from the descriptor in large blocks and buffered, so keep calling
+ * conn_input until it returns 0 or -1; rel_read will not be invoked
+ * again for data that is already sitting in the buffer. */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* Returns non-zero if the connection's input is a regular file that
+ * rlib has memory-mapped (single-connection mode with stdin redirected
+ * from a file).  conn_input then never returns 0 and rel_read is only
+ * invoked once, so the reliable side should pull more input itself as
+ * its send window opens rather than buffering the whole file. */
+int conn_input_mapped (conn_t *c);
+
+/* Returns non-zero if the connection's output is a regular file that
+ * can be written by offset (single-connection mode with stdout
+ * redirected to a file).  The reliable side may then write each
+ * packet's payload into place as soon as it arrives with
+ * conn_output_at, instead of holding it until conn_output can take
+ * it in order.  conn_output is then only used to send the EOF. */
+int conn_output_seekable (conn_t *c);
+
+/* Write len bytes at byte offset off of the output stream.  Returns
+ * len, or -1 if there has been an error. */
+int conn_output_at (conn_t *c, long long off, const void *buf, size_t len);
+
+/* Move len bytes of already-written output from offset from to offset
+ * to.  Returns len, or -1 if there has been an error. */
+int conn_output_move (conn_t *c, long long from, long long to, size_t len);
+
+/* Declare that the first len bytes of output are final.  When the EOF
+ * is written, the file is cut to this length, discarding anything
+ * written speculatively beyond it. */
+void conn_output_commit (conn_t *c, long long len);
+
+/* CLOCK_MONOTONIC time in nanoseconds, as sampled when the event loop
+ * last woke up.  Every callback made in one pass of the loop sees the
+ * same value, so reading it costs nothing; call now_ns_refresh when
+ * you need the time right now instead (which also updates now_ns). */
+extern __thread uint64_t rlib_now;
+static inline uint64_t now_ns (void) { return rlib_now; }
+uint64_t now_ns_refresh (void);
+
+/* Counts the passes of the event loop: it goes up by one each time the
+ * loop wakes up, so callbacks can tell whether they are still in the
+ * same pass as before, however little time has gone by. */
+extern __thread uint64_t rlib_pass;
+static inline uint64_t loop_pass (void) { return rlib_pass; }
+
+/* Ask for rel_timer to be invoked as soon as the now_ns time when is
+ * reached, in addition to its periodic calls.  Only the earliest
+ * outstanding request is kept, and it is forgotten once rel_timer
+ * runs, so rel_timer should renew whatever it still needs. */
+void request_timer_at (uint64_t when);
+
+/* Rate limiting: returns 0 if a packet of len bytes may be sent on c
+ * right now, and charges it to the connection's limit (-L) and the
+ * global one (-G).  Otherwise nothing is charged, and the now_ns time
+ * at which it may be sent is returned; rel_timer will run by then, so
+ * hold on to the packet and try again. */
+uint64_t conn_send_wait (conn_t *c, size_t len);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
@@ -270,6 +345,48 @@ void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 int rel_output (rel_t *);  /* Invoked when some output drained */
 void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
 
+/* Statistics for the control socket (-C).  The counters only ever go
+ * up; the rest describe the connection as it is now. */
+struct rel_stats {
+  uint64_t pkts_sent;		/* data packets, retransmissions included */
+  uint64_t bytes_sent;
+  uint64_t retransmits;
+  uint64_t acks_sent;
+  uint64_t pkts_recv;		/* valid packets, acks included */
+  uint64_t bytes_recv;
+  uint64_t dups;		/* data packets we already had */
+  uint64_t bad;			/* packets failing rel_packet_valid */
+  uint64_t bytes_delivered;	/* payload written to the output */
+
+  uint64_t start_ns;		/* now_ns when the connection was made */
+  uint64_t window;		/* in packets */
+  uint64_t rto_ms;		/* retransmission timeout */
+  uint64_t srtt_ns;		/* smoothed round trip time, 0 if unknown */
+  uint64_t send_queued;		/* packets read but not yet acked */
+  uint64_t in_flight;		/* of those, packets sent at least once */
+  uint64_t recv_queued;		/* packets waiting to be delivered */
+};
+
+/* Counted by the rel_t's own thread, so this may only be called from
+ * there (or with its event loop held still; rlib takes care of it). */
+void rel_stats (rel_t *, struct rel_stats *);
+/* Adds the counters of every connection destroyed so far to st. */
+void rel_stats_closed (struct rel_stats *st);
+
+/* Latency histograms, in microseconds.  Delivery can't be seen from
+ * the sending side, but the receiver only acks what it has delivered,
+ * so it is timed up to the ack, which is at most one trip late. */
+struct rel_hists {
+  hist_t rtt;			/* send to ack, only for packets sent once */
+  hist_t delivery;		/* conn_input to the ack covering it */
+  hist_t recv_wait;		/* time out-of-order packets wait in rec_bq */
+};
+
+/* Add the histograms of a connection (with the same restrictions as
+ * rel_stats), or of every connection destroyed so far, to h. */
+void rel_hists (rel_t *, struct rel_hists *h);
+void rel_hists_closed (struct rel_hists *h);
+
 
 
 /* Below are some utility functions you don't need for this lab */
@@ -0,0 +1,390 @@
+/* Deterministic network simulator: runs flows of reliable.c over a
+ * simulated link, with no sockets and a virtual clock, so a transfer
+ * that would take minutes over a real network takes milliseconds and
+ * comes out the same every time.
+ *
+ * Each flow is a pair of connections made on simlib.  One end sends
+ * size bytes and an EOF, the other just an EOF, and the flow is done
+ * when reliable.c has torn both ends down.  Packets go through an
+ * impairment stage (impair.c) for each direction, with a delay of
+ * 10 ms each way unless -I says otherwise, so loss, jitter, reordering
+ * and so on are whatever -I asks for and are drawn from a generator
+ * seeded with -e.  Input is read as the window opens, as it would be
+ * from a file, and every byte delivered is checked against what was
+ * sent.
+ *
+ * Time jumps straight from one event to the next: a packet falling
+ * due, rel_timer's periodic tick (every timeout/5 ms, as in rlib) or a
+ * time it asked for.  Windows (-w), timeouts (-t) and loss rates (-l,
+ * in percent, overriding any in -I) may be lists, and every
+ * combination is run and printed as a row with the virtual time it
+ * took to deliver everything, goodput and retransmissions up to then.
+ * A run is "ok" if the connections then finish, and "linger" if some
+ * never do: when the last acks of a flow are lost after the receiver
+ * has torn down, the sender keeps resending what they covered to a
+ * peer that's gone, so connections get LINGER_TIMEOUTS timeouts before
+ * we give up on them.  The exit status is 1 if any run didn't deliver
+ * everything intact within -T seconds of virtual time.
+ *
+ * usage: sim [-w windows] [-t timeouts] [-l losses] [-n flows]
+ *            [-s size] [-I impairments] [-e seed] [-T limit] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "simlib.h"
+#include "bench.h"
+#include "impair.h"
+
+#define MAX_LIST 32
+
+/* How long, in timeouts, connections get to finish once everything
+ * has been delivered */
+#define LINGER_TIMEOUTS 100
+
+/* One end of a flow */
+struct end {
+  conn_t *c;			/* NULL once destroyed */
+  rel_t *r;
+  struct end *peer;
+  int dir;			/* which link it sends on */
+};
+
+/* A packet that's to arrive right away */
+struct arrival {
+  struct end *dest;
+  size_t len;
+  char data[IMPAIR_MAX_PKT];
+};
+
+static impair_t *links[2];
+static struct arrival *arrivals;
+static int narrivals, maxarrivals;
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: sim [-w windows] [-t timeouts] [-l losses] [-n flows]\n"
+	   "           [-s size] [-I impairments] [-e seed] [-T limit]\n");
+  exit (1);
+}
+
+/* Parses a comma-separated list of numbers into v, returning how
+ * many there are */
+static int
+parse_list (const char *s, double *v)
+{
+  int n = 0;
+  char *end;
+
+  do {
+    if (n == MAX_LIST)
+      usage ();
+    v[n++] = strtod (s, &end);
+    if (end == s || v[n - 1] < 0 || (*end && *end != ','))
+      usage ();
+    s = end + 1;
+  } while (*end);
+  return n;
+}
+
+static void
+sim_send (conn_t *c, const packet_t *pkt, size_t len)
+{
+  struct end *e = sim_conn_data (c);
+
+  if (impair_packet (links[e->dir], now_ns (), e->peer, pkt, len)
+      != IMPAIR_SEND)
+    return;
+
+  /* Delivering it here would run the peer inside this sender's
+   * conn_sendpkt, so it waits for the event loop */
+  if (narrivals == maxarrivals) {
+    maxarrivals = maxarrivals ? 2 * maxarrivals : 64;
+    arrivals = realloc (arrivals, maxarrivals * sizeof (*arrivals));
+    if (!arrivals) {
+      fprintf (stderr, "sim: out of memory\n");
+      abort ();
+    }
+  }
+  arrivals[narrivals].dest = e->peer;
+  arrivals[narrivals].len = len;
+  memcpy (arrivals[narrivals].data, pkt, len);
+  narrivals++;
+}
+
+static void
+sim_closed (conn_t *c)
+{
+  struct end *e = sim_conn_data (c);
+  e->c = NULL;
+  e->r = NULL;
+}
+
+static void
+deliver (struct end *e, void *pkt, size_t len)
+{
+  /* Packets for a connection that's gone are lost, as they would be
+   * on a closed socket */
+  if (e->r)
+    rel_recvpkt (e->r, pkt, len);
+}
+
+/* Delivers everything that's arrived by now, including whatever the
+ * deliveries themselves send */
+static void
+deliver_due (void)
+{
+  char buf[IMPAIR_MAX_PKT];
+  struct arrival a;
+  void *dest;
+  int i, n, more;
+
+  do {
+    more = 0;
+    for (i = 0; i < narrivals; i++) {
+      a = arrivals[i];
+      deliver (a.dest, a.data, a.len);
+      more = 1;
+    }
+    /* Anything added while delivering is after the ones just done */
+    memmove (arrivals, arrivals + i, (narrivals - i) * sizeof (*arrivals));
+    narrivals -= i;
+
+    for (i = 0; i < 2; i++)
+      while ((n = impair_due (links[i], now_ns (), &dest, buf)) >= 0) {
+	deliver (dest, buf, n);
+	more = 1;
+      }
+  } while (more);
+}
+
+static uint64_t
+min64 (uint64_t a, uint64_t b)
+{
+  return a < b ? a : b;
+}
+
+/* Adds up the counters of every connection there's been, open or not,
+ * less those in before */
+static void
+sum_stats (struct end *ends, int n, const struct rel_stats *before,
+	   struct rel_stats *st)
+{
+  uint64_t *to = (uint64_t *) st;
+  const uint64_t *from = (const uint64_t *) before;
+  struct rel_stats one;
+  int i;
+
+  memset (st, 0, sizeof (*st));
+  rel_stats_closed (st);
+  for (i = 0; i < n; i++)
+    if (ends[i].r) {
+      uint64_t *p = (uint64_t *) &one;
+      int j;
+      rel_stats (ends[i].r, &one);
+      for (j = 0; &p[j] < &one.start_ns; j++)
+	to[j] += p[j];
+    }
+  for (i = 0; &to[i] < &st->start_ns; i++)
+    to[i] -= from[i];
+}
+
+struct result {
+  uint64_t done_ns;		/* virtual time to deliver everything */
+  uint64_t ns;			/* and to tear everything down */
+  uint64_t wall_ns;
+  struct rel_stats st;		/* counters, when everything was delivered */
+  int intact;			/* everything delivered, unchanged */
+  int torn_down;		/* every connection finished */
+};
+
+/* Runs nflows flows of size bytes each from start until they're all
+ * finished or limit ns have gone by */
+static void
+run (const struct config_common *cc, const impair_conf_t *ic, int nflows,
+     size_t size, uint64_t start, uint64_t limit, struct result *res)
+{
+  struct end *ends = xmalloc (2 * nflows * sizeof (*ends));
+  struct rel_stats before;
+  uint64_t now = start, tick, deadline = UINT64_MAX, output, bad, wall;
+  uint64_t expect = (uint64_t) nflows * size;
+  uint64_t linger = LINGER_TIMEOUTS * cc->timeout * 1000000ULL;
+  int i;
+
+  memset (&before, 0, sizeof (before));
+  rel_stats_closed (&before);
+  output = sim_bytes_output;
+  bad = sim_bytes_bad;
+  wall = wall_ns ();
+
+  links[0] = impair_new (ic, 0);
+  links[1] = impair_new (ic, 1);
+  if (!links[0] || !links[1]) {
+    fprintf (stderr, "sim: out of memory\n");
+    abort ();
+  }
+
+  sim_set_time (now);
+  sim_timer_due ();
+  for (i = 0; i < 2 * nflows; i++) {
+    struct end *e = &ends[i];
+    e->c = sim_conn_new ();
+    sim_conn_set_data (e->c, e);
+    e->peer = &ends[i ^ 1];
+    e->dir = i & 1;
+    e->r = rel_create (e->c, NULL, cc);
+    sim_conn_feed (e->c, e->dir ? 0 : size, 1);
+  }
+  for (i = 0; i < 2 * nflows; i++)
+    if (ends[i].r)
+      rel_read (ends[i].r);
+  tick = now + cc->timer * 1000000ULL;
+  res->done_ns = 0;
+
+  while (1) {
+    deliver_due ();
+    deadline = min64 (deadline, sim_timer_due ());
+
+    if (now >= tick || now >= deadline) {
+      deadline = UINT64_MAX;
+      rel_timer ();
+      if (now >= tick)
+	tick = now + cc->timer * 1000000ULL;
+      deliver_due ();
+      deadline = min64 (deadline, sim_timer_due ());
+    }
+    if (!res->done_ns && sim_bytes_output - output == expect) {
+      res->done_ns = now - start;
+      sum_stats (ends, 2 * nflows, &before, &res->st);
+    }
+    if (!sim_conns || now - start >= limit
+	|| (res->done_ns && now - start >= res->done_ns + linger))
+      break;
+
+    now = min64 (min64 (impair_next (links[0]), impair_next (links[1])),
+		 min64 (deadline < now ? now : deadline, tick));
+    if (now - start > limit)
+      now = start + limit;
+    sim_set_time (now);
+  }
+
+  res->torn_down = !sim_conns;
+  res->ns = now - start;
+  if (!res->done_ns)
+    sum_stats (ends, 2 * nflows, &before, &res->st);
+
+  /* Clear out what didn't finish, so the next run starts empty */
+  for (i = 0; i < 2 * nflows; i++)
+    if (ends[i].r)
+      rel_destroy (ends[i].r);
+  impair_destroy (links[0]);
+  impair_destroy (links[1]);
+  narrivals = 0;
+
+  res->wall_ns = wall_ns () - wall;
+  res->intact = res->done_ns && sim_bytes_bad == bad;
+  free (ends);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct config_common cc;
+  impair_conf_t ic;
+  double windows[MAX_LIST] = { 32 }, timeouts[MAX_LIST] = { 200 };
+  double losses[MAX_LIST];
+  int nwindows = 1, ntimeouts = 1, nlosses = 0, nflows = 1, failed = 0;
+  int opt, w, t, l;
+  size_t size = 1000000;
+  uint64_t limit = 3600, seed = 1;
+
+  memset (&ic, 0, sizeof (ic));
+  ic.delay = 10000000;
+
+  while ((opt = getopt (argc, argv, "w:t:l:n:s:I:e:T:")) != -1)
+    switch (opt) {
+    case 'w':
+      nwindows = parse_list (optarg, windows);
+      break;
+    case 't':
+      ntimeouts = parse_list (optarg, timeouts);
+      break;
+    case 'l':
+      nlosses = parse_list (optarg, losses);
+      break;
+    case 'n':
+      nflows = atoi (optarg);
+      break;
+    case 's':
+      size = strtoull (optarg, NULL, 0);
+      break;
+    case 'I':
+      if (impair_parse (&ic, optarg) < 0) {
+	fprintf (stderr, "sim: bad impairment list %s\n", optarg);
+	exit (1);
+      }
+      break;
+    case 'e':
+      seed = strtoull (optarg, NULL, 0);
+      break;
+    case 'T':
+      limit = strtoull (optarg, NULL, 0);
+      break;
+    default:
+      usage ();
+    }
+  if (optind != argc || nflows <= 0 || !limit)
+    usage ();
+  ic.seed = seed;
+  if (!nlosses) {
+    losses[0] = ic.loss * 100;
+    nlosses = 1;
+  }
+
+  sim_sendpkt = sim_send;
+  sim_conn_closed = sim_closed;
+  sim_input_mapped = 1;
+  sim_verify = 1;
+
+  printf ("%7s %8s %6s %10s %12s %9s %8s %7s %8s  %s\n", "window",
+	  "timeout", "loss%", "virtual_s", "goodput_B/s", "pkts", "retx",
+	  "retx%", "wall_ms", "result");
+  for (w = 0; w < nwindows; w++)
+    for (t = 0; t < ntimeouts; t++)
+      for (l = 0; l < nlosses; l++) {
+	struct result res;
+	uint64_t done;
+
+	memset (&cc, 0, sizeof (cc));
+	cc.window = windows[w];
+	cc.timeout = timeouts[t];
+	cc.timer = cc.timeout / 5 > 0 ? cc.timeout / 5 : 1;
+	ic.loss = losses[l] / 100;
+	if (cc.window <= 0 || cc.timeout <= 0 || ic.loss > 1)
+	  usage ();
+
+	/* Packets not sent yet count as sent at time 0, so start late
+	 * enough for them to be due */
+	run (&cc, &ic, nflows, size, 2 * cc.timeout * 1000000ULL,
+	     limit * 1000000000ULL, &res);
+
+	/* Time and goodput are up to the last byte delivered */
+	done = res.done_ns ? res.done_ns : res.ns;
+	printf ("%7d %8d %6g %10.3f %12.0f %9llu %8llu %7.2f %8.1f  %s\n",
+		cc.window, cc.timeout, losses[l], done / 1e9,
+		res.done_ns ? (double) nflows * size / (done / 1e9) : 0,
+		(unsigned long long) res.st.pkts_sent,
+		(unsigned long long) res.st.retransmits,
+		res.st.pkts_sent
+		? 100.0 * res.st.retransmits / res.st.pkts_sent : 0,
+		res.wall_ns / 1e6,
+		!res.intact ? "FAIL" : !res.torn_down ? "linger" : "ok");
+	failed |= !res.intact;
+      }
+  return failed;
+}
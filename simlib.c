@@ -0,0 +1,265 @@
+/* rlib stand-in for benchmarks; see simlib.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+#include "simlib.h"
+#include "bench.h"
+#include "pool.h"
+
+struct conn {
+  rel_t *rel;			/* set by conn_create */
+  size_t input;			/* bytes conn_input will still hand out */
+  int input_eof;		/* then an EOF */
+  uint64_t input_off;		/* bytes handed out so far */
+  uint64_t output_off;		/* and written */
+  void *data;			/* the caller's */
+};
+
+static pool_t conn_pool = POOL_INIT ("conn_t", sizeof (conn_t));
+
+char *progname = "sim";
+int opt_debug;
+
+__thread uint64_t rlib_now;
+__thread uint64_t rlib_pass;
+static uint64_t timer_due = UINT64_MAX;
+
+void (*sim_sendpkt) (conn_t *c, const packet_t *pkt, size_t len);
+void (*sim_conn_closed) (conn_t *c);
+conn_t *sim_last_conn;
+int sim_input_mapped;
+int sim_verify;
+long sim_conns;
+uint64_t sim_pkts_sent;
+uint64_t sim_bytes_output;
+uint64_t sim_bytes_bad;
+
+#if !DMALLOC
+void *
+xmalloc (size_t n)
+{
+  void *p = malloc (n);
+  if (!p) {
+    fprintf (stderr, "%s: out of memory allocating %d bytes\n",
+	     progname, (int) n);
+    abort ();
+  }
+  return p;
+}
+#endif /* !DMALLOC */
+
+uint16_t
+cksum (const void *_data, int len)
+{
+  const uint8_t *data = _data;
+  uint32_t sum;
+
+  for (sum = 0;len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons (~sum);
+  return sum ? sum : 0xffff;
+}
+
+int
+addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+  return a->ss_family == b->ss_family && !memcmp (a, b, addrsize (a));
+}
+
+size_t
+addrsize (const struct sockaddr_storage *ss)
+{
+  switch (ss->ss_family) {
+  case AF_INET:
+    return sizeof (struct sockaddr_in);
+  case AF_INET6:
+    return sizeof (struct sockaddr_in6);
+  case AF_UNIX:
+    return sizeof (struct sockaddr_un);
+  }
+  return sizeof (*ss);
+}
+
+void
+print_pkt (const packet_t *buf, const char *op, int n)
+{
+}
+
+conn_t *
+sim_conn_new (void)
+{
+  conn_t *c = pool_alloc (&conn_pool);
+  memset (c, 0, sizeof (*c));
+  sim_conns++;
+  return c;
+}
+
+void
+sim_conn_feed (conn_t *c, size_t len, int eof)
+{
+  c->input += len;
+  c->input_eof = eof;
+}
+
+void
+sim_set_time (uint64_t now)
+{
+  rlib_now = now;
+  rlib_pass++;
+}
+
+uint64_t
+sim_timer_due (void)
+{
+  uint64_t due = timer_due;
+  timer_due = UINT64_MAX;
+  return due;
+}
+
+conn_t *
+conn_create (rel_t *r, const struct sockaddr_storage *ss)
+{
+  conn_t *c = sim_conn_new ();
+  c->rel = r;
+  sim_last_conn = c;
+  return c;
+}
+
+rel_t *
+sim_conn_rel (conn_t *c)
+{
+  return c->rel;
+}
+
+void
+sim_conn_set_data (conn_t *c, void *data)
+{
+  c->data = data;
+}
+
+void *
+sim_conn_data (conn_t *c)
+{
+  return c->data;
+}
+
+void
+conn_destroy (conn_t *c)
+{
+  if (sim_conn_closed)
+    sim_conn_closed (c);
+  sim_conns--;
+  pool_free (&conn_pool, c);
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  sim_pkts_sent++;
+  if (sim_sendpkt)
+    sim_sendpkt (c, pkt, len);
+  return len;
+}
+
+void
+conn_trace (conn_t *c, int event, const packet_t *pkt, int n)
+{
+  trace_record (event, pkt, n, 0, 0);
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+  return 1 << 20;
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t len)
+{
+  const uint8_t *p = buf;
+  size_t i;
+
+  if (sim_verify)
+    for (i = 0; i < len; i++)
+      if (p[i] != bench_pattern (c->output_off + i))
+	sim_bytes_bad++;
+  c->output_off += len;
+  sim_bytes_output += len;
+  return len;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t len)
+{
+  if (!c->input)
+    return c->input_eof ? -1 : 0;
+  if (len > c->input)
+    len = c->input;
+  if (sim_verify) {
+    uint8_t *p = buf;
+    size_t i;
+    for (i = 0; i < len; i++)
+      p[i] = bench_pattern (c->input_off + i);
+  }
+  else
+    memset (buf, 0, len);
+  c->input -= len;
+  c->input_off += len;
+  return len;
+}
+
+int
+conn_input_mapped (conn_t *c)
+{
+  return sim_input_mapped;
+}
+
+int
+conn_output_seekable (conn_t *c)
+{
+  return 0;
+}
+
+int
+conn_output_at (conn_t *c, long long off, const void *buf, size_t len)
+{
+  return -1;
+}
+
+int
+conn_output_move (conn_t *c, long long from, long long to, size_t len)
+{
+  return -1;
+}
+
+void
+conn_output_commit (conn_t *c, long long len)
+{
+}
+
+uint64_t
+conn_send_wait (conn_t *c, size_t len)
+{
+  return 0;
+}
+
+uint64_t
+now_ns_refresh (void)
+{
+  return rlib_now;
+}
+
+void
+request_timer_at (uint64_t when)
+{
+  if (when < timer_due)
+    timer_due = when;
+}
@@ -0,0 +1,56 @@
+/* simlib: a stand-in for rlib that runs reliable.c without sockets,
+ * files or a real clock, for benchmarks and the simulator (sim.c).
+ *
+ * Connections live in memory: input is whatever the caller feeds in
+ * with sim_conn_feed, output is counted and thrown away, and packets
+ * go to sim_sendpkt if it is set (otherwise they are only counted).
+ * now_ns only moves when the caller sets it, and request_timer_at
+ * just remembers the earliest time asked for.  Rate limits are off. */
+
+#include "rlib.h"
+
+/* Makes a connection to hand to rel_create.  conn_create (server
+ * mode) makes them the same way. */
+conn_t *sim_conn_new (void);
+
+/* The connection conn_create (called from rel_create in rel_demux)
+ * made last, and the rel_t it was made for. */
+extern conn_t *sim_last_conn;
+rel_t *sim_conn_rel (conn_t *c);
+
+/* A pointer of the caller's own to keep with a connection */
+void sim_conn_set_data (conn_t *c, void *data);
+void *sim_conn_data (conn_t *c);
+
+/* Called as a connection is destroyed, if set. */
+extern void (*sim_conn_closed) (conn_t *c);
+
+/* Make len more bytes of input available on c, followed by an EOF if
+ * eof is set.  The bytes are all zero, unless sim_verify is set. */
+void sim_conn_feed (conn_t *c, size_t len, int eof);
+
+/* If set, connections claim their input is a mapped file, so it is
+ * read only as the window opens rather than all at once. */
+extern int sim_input_mapped;
+
+/* If set, input is a pattern that depends on the offset in the
+ * stream rather than zeros, and output is checked against it:
+ * sim_bytes_bad counts bytes that don't match. */
+extern int sim_verify;
+
+/* Set the time now_ns returns, and start a new pass of the event
+ * loop as far as loop_pass is concerned. */
+void sim_set_time (uint64_t now);
+
+/* The earliest time passed to request_timer_at since the last call,
+ * or UINT64_MAX if none.  Clears the request. */
+uint64_t sim_timer_due (void);
+
+/* Called for every packet a connection sends, if set. */
+extern void (*sim_sendpkt) (conn_t *c, const packet_t *pkt, size_t len);
+
+/* Totals over all connections, and how many are open */
+extern uint64_t sim_pkts_sent;
+extern uint64_t sim_bytes_output;
+extern uint64_t sim_bytes_bad;
+extern long sim_conns;
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+/*
+ * Private
+ */
+
+#define SLAB_CLASSES 6		/* 16, 32, ... 512 */
+#define SLAB_HEADER 64		/* a cache line for the chunk header */
+
+typedef struct slab_chunk {
+    size_t size;
+} slab_chunk_t;
+
+/* A free object holds the pointer to the next one */
+
+static __thread void* free_list[SLAB_CLASSES];
+
+/* Returns the index of the smallest size class that fits len bytes.
+ */
+
+static int slab_class(size_t len)
+{
+    int class = 0;
+    size_t size = SLAB_MIN;
+
+    while (size < len) {
+        size <<= 1;
+        class++;
+    }
+    assert(class < SLAB_CLASSES);
+    return class;
+}
+
+/* Carves a new chunk up into objects of a size class, and puts them all
+ * on the free list. They go on back to front, so they're handed out in
+ * address order.
+ */
+
+static void slab_grow(int class)
+{
+    size_t size = (size_t)SLAB_MIN << class;
+
+    slab_chunk_t* chunk;
+    int err = posix_memalign((void**)&chunk, SLAB_CHUNK, SLAB_CHUNK);
+    assert(err == 0);
+    chunk->size = size;
+
+    size_t first = (SLAB_HEADER + size - 1) / size * size;
+    size_t off;
+    for (off = SLAB_CHUNK - size; off >= first; off -= size) {
+        void* p = (char*)chunk + off;
+        *(void**)p = free_list[class];
+        free_list[class] = p;
+    }
+}
+
+static slab_chunk_t* slab_chunk_of(void* p)
+{
+    return (slab_chunk_t*)((uintptr_t)p & ~(uintptr_t)(SLAB_CHUNK - 1));
+}
+
+/*
+ * Public
+ */
+
+void *slab_alloc(size_t len)
+{
+    assert(len > 0 && len <= SLAB_MAX);
+
+    int class = slab_class(len);
+    if (!free_list[class]) slab_grow(class);
+
+    void* p = free_list[class];
+    free_list[class] = *(void**)p;
+    return p;
+}
+
+void slab_free(void *p)
+{
+    assert(p);
+
+    int class = slab_class(slab_chunk_of(p)->size);
+    *(void**)p = free_list[class];
+    free_list[class] = p;
+}
+
+size_t slab_size(void *p)
+{
+    assert(p);
+
+    return slab_chunk_of(p)->size;
+}
@@ -0,0 +1,45 @@
+/*
+ * PAYLOAD SLAB
+ *
+ * A size-classed allocator for packets, so that a queue slot only has
+ * to hold a pointer, and a short packet only pins as much memory as
+ * its size class instead of a whole packet_t. Objects come in powers
+ * of two from SLAB_MIN up to SLAB_MAX bytes, carved out of SLAB_CHUNK
+ * byte chunks. Each chunk holds a single size class, and is aligned to
+ * its own size, so slab_free can find the class from the pointer alone.
+ *
+ *   chunk (SLAB_CHUNK aligned)
+ *   -----------------------------------------------
+ *   | header | obj | obj | obj | ...         | obj |
+ *   -----------------------------------------------
+ *
+ * Free objects are kept on per-thread free lists, and chunks are never
+ * handed back, so an object has to be freed by the thread that
+ * allocated it. That holds for everything a rel_t owns, since a
+ * connection never leaves the worker it was created on.
+ */
+
+#include <stddef.h>
+
+#define SLAB_MIN 16
+#define SLAB_MAX 512
+#define SLAB_CHUNK (64 * 1024)
+
+/**
+ * Returns room for len bytes (0 < len <= SLAB_MAX), from the smallest
+ * size class that fits. Asserts if memory runs out.
+ */
+
+void *slab_alloc(size_t len);
+
+/**
+ * Hands an object back to this thread's free list for its class.
+ */
+
+void slab_free(void *p);
+
+/**
+ * Returns the size of the class an object came from.
+ */
+
+size_t slab_size(void *p);
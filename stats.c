@@ -0,0 +1,83 @@
+#include <assert.h>
+
+#include "stats.h"
+#include "pool.h"
+
+/*
+ * Private
+ */
+
+static const char* mem_names[MEM_KINDS] = {
+    "conn", "sendq", "recvq", "input", "output"
+};
+
+static long mem_bytes[MEM_KINDS];
+static long mem_high[MEM_KINDS];	/* most mem_bytes has been */
+static long mem_conn_max[MEM_KINDS];	/* most one memacct_t has held */
+static long mem_all;
+static long mem_all_high;
+
+/* Raises *max to at least value. */
+
+static void mem_raise(long* max, long value)
+{
+    long cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > cur
+           && !__atomic_compare_exchange_n(max, &cur, value, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Public
+ */
+
+void mem_charge(memacct_t* acct, int kind, long bytes)
+{
+    assert(kind >= 0 && kind < MEM_KINDS);
+
+    long total = __atomic_add_fetch(&mem_bytes[kind], bytes, __ATOMIC_RELAXED);
+    long all = __atomic_add_fetch(&mem_all, bytes, __ATOMIC_RELAXED);
+
+    if (bytes > 0) {
+        mem_raise(&mem_high[kind], total);
+        mem_raise(&mem_all_high, all);
+    }
+
+    if (acct) {
+        acct->bytes[kind] += bytes;
+        if (bytes > 0) mem_raise(&mem_conn_max[kind], acct->bytes[kind]);
+    }
+}
+
+long mem_total(int kind)
+{
+    assert(kind >= 0 && kind < MEM_KINDS);
+
+    return __atomic_load_n(&mem_bytes[kind], __ATOMIC_RELAXED);
+}
+
+const char* mem_kind_name(int kind)
+{
+    assert(kind >= 0 && kind < MEM_KINDS);
+
+    return mem_names[kind];
+}
+
+void stats_dump(FILE* out)
+{
+    int i;
+
+    fprintf(out, "%-8s %14s %14s %14s\n", "memory", "bytes", "high", "conn max");
+    for (i = 0; i < MEM_KINDS; i++) {
+        fprintf(out, "%-8s %14ld %14ld %14ld\n", mem_names[i],
+                __atomic_load_n(&mem_bytes[i], __ATOMIC_RELAXED),
+                __atomic_load_n(&mem_high[i], __ATOMIC_RELAXED),
+                __atomic_load_n(&mem_conn_max[i], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "%-8s %14ld %14ld\n", "total",
+            __atomic_load_n(&mem_all, __ATOMIC_RELAXED),
+            __atomic_load_n(&mem_all_high, __ATOMIC_RELAXED));
+
+    pool_stats(out);
+    fflush(out);
+}
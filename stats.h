@@ -0,0 +1,61 @@
+/*
+ * MEMORY ACCOUNTING
+ *
+ * Counts the bytes held for each kind of thing a connection keeps in
+ * memory, so a running process can say where its memory is going:
+ *
+ *   MEM_CONN     rel_t's and conn_t's themselves
+ *   MEM_SENDQ    send queues and the packets in them
+ *   MEM_RECVQ    receive queues and the packets in them
+ *   MEM_INPUT    block-read input buffers
+ *   MEM_OUTPUT   output chunks waiting to be written
+ *
+ * Every connection object has a memacct_t, and charges what it
+ * allocates to it (negative amounts for what it frees), which keeps
+ * the process totals and their high-water marks, and the most any one
+ * connection has held of each kind. Totals are updated atomically, so
+ * any thread may charge, but a memacct_t belongs to one thread.
+ *
+ * stats_dump writes all of it out, along with the pool counts. rlib
+ * does that on SIGUSR1.
+ */
+
+#include <stdio.h>
+
+enum mem_kind {
+    MEM_CONN,
+    MEM_SENDQ,
+    MEM_RECVQ,
+    MEM_INPUT,
+    MEM_OUTPUT,
+    MEM_KINDS
+};
+
+typedef struct memacct {
+    long bytes[MEM_KINDS];
+} memacct_t;
+
+/**
+ * Adds bytes (which may be negative) to kind, for acct and the process.
+ */
+
+void mem_charge(memacct_t* acct, int kind, long bytes);
+
+/**
+ * Returns the bytes currently held of kind by the whole process.
+ */
+
+long mem_total(int kind);
+
+/**
+ * Returns the name stats_dump uses for kind.
+ */
+
+const char* mem_kind_name(int kind);
+
+/**
+ * Writes current bytes, high-water marks and per-connection maxima for
+ * every kind, then the pool counts.
+ */
+
+void stats_dump(FILE* out);
@@ -0,0 +1,102 @@
+/* Benchmark for rel_timer's sweep over the send window.
+ *
+ * For each window size from 1 up to the maximum (doubling), sets up
+ * enough connections to have about slots packets in flight in total,
+ * sends a full window on each, and then times rel_timer passes during
+ * which nothing is due for retransmission, so what gets measured is
+ * the scan itself.  Runs on simlib, so there are no sockets and the
+ * clock only moves between passes.
+ *
+ * usage: timerbench [-p passes] [-s slots] [max-window] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "simlib.h"
+#include "bench.h"
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: timerbench [-p passes] [-s slots] [max-window]\n");
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct config_common cc;
+  int passes = 200, slots = 65536, maxwin = 4096;
+  int opt, w, i, p;
+  uint64_t now;
+
+  while ((opt = getopt (argc, argv, "p:s:")) != -1)
+    switch (opt) {
+    case 'p':
+      passes = atoi (optarg);
+      break;
+    case 's':
+      slots = atoi (optarg);
+      break;
+    default:
+      usage ();
+    }
+  if (optind < argc)
+    maxwin = atoi (argv[optind++]);
+  if (optind != argc || passes <= 0 || slots <= 0 || maxwin <= 0)
+    usage ();
+
+  memset (&cc, 0, sizeof (cc));
+  cc.timer = 10;
+  cc.timeout = 1000000;		/* nothing comes due while we time */
+
+  /* Packets not sent yet count as sent at time 0, so start late
+   * enough for them to be due */
+  now = 2 * cc.timeout * 1000000ULL;
+
+  printf ("%8s %8s %12s %10s\n", "window", "conns", "ns/pass", "ns/slot");
+  for (w = 1; w <= maxwin; w *= 2) {
+    int nconns = slots / w > 0 ? slots / w : 1;
+    rel_t **rels = xmalloc (nconns * sizeof (*rels));
+    uint64_t start, ns;
+
+    cc.window = w;
+    sim_pkts_sent = 0;
+    for (i = 0; i < nconns; i++) {
+      conn_t *c = sim_conn_new ();
+      rels[i] = rel_create (c, NULL, &cc);
+      sim_conn_feed (c, (size_t) w * 500, 0);
+      rel_read (rels[i]);
+    }
+
+    /* The round robin only lets so many packets out per pass, so run
+     * passes until every window is full */
+    while (sim_pkts_sent < (uint64_t) nconns * w) {
+      sim_set_time (now += 1000);
+      rel_timer ();
+    }
+
+    start = wall_ns ();
+    for (p = 0; p < passes; p++) {
+      sim_set_time (now += 1000);
+      rel_timer ();
+    }
+    ns = wall_ns () - start;
+    if (sim_pkts_sent != (uint64_t) nconns * w) {
+      fprintf (stderr, "timerbench: packets resent while timing\n");
+      exit (1);
+    }
+
+    printf ("%8d %8d %12.0f %10.2f\n", w, nconns, (double) ns / passes,
+	    (double) ns / passes / ((double) nconns * w));
+    fflush (stdout);
+
+    for (i = 0; i < nconns; i++)
+      rel_destroy (rels[i]);
+    free (rels);
+  }
+  return 0;
+}
@@ -0,0 +1,360 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+trace_rec_t* trace_ring;
+
+/*
+ * Private
+ */
+
+static uint64_t trace_mask;	/* entries - 1 */
+static uint64_t trace_head;	/* events ever recorded (atomic) */
+static const char* trace_path;
+static uint32_t trace_addr;
+static uint16_t trace_port;
+static int trace_dumping;	/* a dump is going on (atomic) */
+
+static const char* event_names[TRACE_EVENTS] = {
+    "send", "retransmit", "ack", "recv", "bad", "drop"
+};
+
+/* Dumps are written through this buffer, since stdio isn't safe in a
+ * signal handler. Only one dump runs at once. */
+
+static char dump_buf[65536];
+static size_t dump_len;
+static int dump_fd;
+static int dump_err;
+
+static void dump_flush(void)
+{
+    size_t off = 0;
+
+    while (off < dump_len && !dump_err) {
+        ssize_t n = write(dump_fd, dump_buf + off, dump_len - off);
+        if (n < 0 && errno != EINTR) dump_err = errno;
+        if (n > 0) off += n;
+    }
+    dump_len = 0;
+}
+
+static void dump_put(const void* data, size_t len)
+{
+    if (dump_len + len > sizeof(dump_buf)) dump_flush();
+    memcpy(dump_buf + dump_len, data, len);
+    dump_len += len;
+}
+
+static void dump_u32(uint32_t v)
+{
+    dump_put(&v, 4);
+}
+
+/* Copies out the record at pos, if it's still there and not being
+ * written over. Returns 0 if it isn't. */
+
+static int trace_read(uint64_t pos, trace_rec_t* rec)
+{
+    trace_rec_t* r = &trace_ring[pos & trace_mask];
+    uint64_t stamp = __atomic_load_n(&r->stamp, __ATOMIC_ACQUIRE);
+
+    if (stamp != pos + 1) return 0;
+    *rec = *r;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->stamp, __ATOMIC_RELAXED) == stamp;
+}
+
+static int path_is_pcap(const char* path)
+{
+    size_t n = strlen(path);
+
+    return (n >= 5 && !strcmp(path + n - 5, ".pcap"))
+           || (n >= 7 && !strcmp(path + n - 7, ".pcapng"));
+}
+
+static int64_t realtime_offset(void)
+{
+    struct timespec mono, real;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    return ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000
+           + (real.tv_nsec - mono.tv_nsec);
+}
+
+/* Section header and interface description blocks. The interface
+ * carries raw IP (LINKTYPE_RAW) with nanosecond timestamps. */
+
+static void pcapng_head(void)
+{
+    uint16_t version[2] = { 1, 0 };
+    int64_t section_len = -1;
+
+    dump_u32(0x0a0d0d0a);
+    dump_u32(28);
+    dump_u32(0x1a2b3c4d);
+    dump_put(version, 4);
+    dump_put(&section_len, 8);
+    dump_u32(28);
+
+    uint16_t link[2] = { 101, 0 };
+    uint16_t tsresol[2] = { 9, 1 };
+    uint8_t nano[4] = { 9, 0, 0, 0 };
+
+    dump_u32(1);
+    dump_u32(32);
+    dump_put(link, 4);
+    dump_u32(0);		/* no snap length */
+    dump_put(tsresol, 4);
+    dump_put(nano, 4);
+    dump_u32(0);		/* end of options */
+    dump_u32(32);
+}
+
+static uint16_t ip_cksum(const uint8_t* hdr)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < 20; i += 2) sum += (hdr[i] << 8) | hdr[i + 1];
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* An enhanced packet block holding rec as IPv4/UDP between us and the
+ * peer, with as much of the header as was sent, and the event as a
+ * comment. */
+
+static void pcapng_packet(const trace_rec_t* rec, int64_t realtime)
+{
+    int in = rec->event == TRACE_RECV || rec->event == TRACE_BAD;
+    uint32_t src = in ? rec->addr : trace_addr;
+    uint32_t dst = in ? trace_addr : rec->addr;
+    uint16_t sport = in ? rec->port : trace_port;
+    uint16_t dport = in ? trace_port : rec->port;
+    uint32_t hlen = rec->size < 12 ? rec->size : 12;
+    uint32_t iplen = 28 + rec->size;
+    uint8_t pkt[40];
+
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x45;
+    pkt[2] = iplen >> 8;
+    pkt[3] = iplen;
+    pkt[6] = 0x40;		/* don't fragment */
+    pkt[8] = 64;
+    pkt[9] = 17;		/* UDP */
+    memcpy(pkt + 12, &src, 4);
+    memcpy(pkt + 16, &dst, 4);
+    uint16_t sum = ip_cksum(pkt);
+    pkt[10] = sum >> 8;
+    pkt[11] = sum;
+
+    memcpy(pkt + 20, &sport, 2);
+    memcpy(pkt + 22, &dport, 2);
+    pkt[24] = (8 + rec->size) >> 8;
+    pkt[25] = 8 + rec->size;
+
+    memcpy(pkt + 28, &rec->cksum, 2);
+    memcpy(pkt + 30, &rec->len, 2);
+    memcpy(pkt + 32, &rec->ackno, 4);
+    memcpy(pkt + 36, &rec->seqno, 4);
+
+    const char* name = event_names[rec->event];
+    uint32_t caplen = 28 + hlen;
+    uint32_t namelen = strlen(name);
+    uint32_t padded = (caplen + 3) & ~3;
+    uint32_t namepad = (namelen + 3) & ~3;
+    uint32_t total = 28 + padded + 8 + 4 + namepad + 4 + 4;
+    uint64_t ts = rec->ns + realtime;
+    uint16_t opt[2];
+    static const uint8_t zero[4];
+
+    dump_u32(6);
+    dump_u32(total);
+    dump_u32(0);		/* interface */
+    dump_u32(ts >> 32);
+    dump_u32(ts);
+    dump_u32(caplen);
+    dump_u32(iplen);
+    dump_put(pkt, caplen);
+    dump_put(zero, padded - caplen);
+
+    opt[0] = 2;			/* epb_flags: direction */
+    opt[1] = 4;
+    dump_put(opt, 4);
+    dump_u32(in ? 1 : 2);
+
+    opt[0] = 1;			/* opt_comment */
+    opt[1] = namelen;
+    dump_put(opt, 4);
+    dump_put(name, namelen);
+    dump_put(zero, namepad - namelen);
+
+    dump_u32(0);		/* end of options */
+    dump_u32(total);
+}
+
+static void trace_signal(int sig)
+{
+    int saved_errno = errno;
+
+    trace_dump(trace_path);
+    errno = saved_errno;
+}
+
+static void trace_crash(int sig)
+{
+    trace_dump(trace_path);
+    raise(sig);
+}
+
+/*
+ * Public
+ */
+
+int trace_open(const char* path, int entries)
+{
+    assert(path);
+    assert(entries > 0 && !(entries & (entries - 1)));
+
+    trace_rec_t* ring = calloc(entries, sizeof(trace_rec_t));
+    if (!ring) return -1;
+
+    trace_path = path;
+    trace_mask = entries - 1;
+    __atomic_store_n(&trace_ring, ring, __ATOMIC_RELEASE);
+
+    struct sigaction sa;
+    static const int fatal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    sa.sa_handler = trace_crash;
+    sa.sa_flags = SA_RESETHAND;
+    for (i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+        sigaction(fatal[i], &sa, NULL);
+    }
+    return 0;
+}
+
+void trace_local(uint32_t addr, uint16_t port)
+{
+    trace_addr = addr;
+    trace_port = port;
+}
+
+void trace_record(int event, const void* pkt, int n,
+                  uint32_t addr, uint16_t port)
+{
+    assert(event >= 0 && event < TRACE_EVENTS);
+
+    if (!trace_ring || n < 0) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t pos = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_rec_t* r = &trace_ring[pos & trace_mask];
+    const char* p = pkt;
+
+    /* Like a seqlock: readers ignore the slot while stamp is 0 or
+     * changes under them */
+
+    __atomic_store_n(&r->stamp, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    r->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->cksum = r->len = 0;
+    r->ackno = r->seqno = 0;
+    if (n >= 4) {
+        memcpy(&r->cksum, p, 2);
+        memcpy(&r->len, p + 2, 2);
+    }
+    if (n >= 8) memcpy(&r->ackno, p + 4, 4);
+    if (n >= 12) memcpy(&r->seqno, p + 8, 4);
+    r->addr = addr;
+    r->port = port;
+    r->size = n;
+    r->event = event;
+
+    __atomic_store_n(&r->stamp, pos + 1, __ATOMIC_RELEASE);
+}
+
+int trace_dump(const char* path)
+{
+    assert(path);
+
+    if (!trace_ring) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (__atomic_exchange_n(&trace_dumping, 1, __ATOMIC_ACQUIRE)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    dump_fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (dump_fd < 0) {
+        __atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    dump_len = 0;
+    dump_err = 0;
+
+    int pcap = path_is_pcap(path);
+    int64_t realtime = realtime_offset();
+    trace_file_t head;
+
+    if (pcap) {
+        pcapng_head();
+    } else {
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic, "RELTRACE", 8);
+        head.rec_size = sizeof(trace_rec_t);
+        head.realtime = realtime;
+        head.addr = trace_addr;
+        head.port = trace_port;
+        dump_put(&head, sizeof(head));
+    }
+
+    uint64_t end = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t pos = end > trace_mask + 1 ? end - trace_mask - 1 : 0;
+    trace_rec_t rec;
+
+    for (; pos < end; pos++) {
+        if (!trace_read(pos, &rec)) continue;
+        if (pcap) {
+            pcapng_packet(&rec, realtime);
+        } else {
+            dump_put(&rec, sizeof(rec));
+            head.count++;
+        }
+    }
+    dump_flush();
+
+    if (!pcap && !dump_err
+        && pwrite(dump_fd, &head, sizeof(head), 0) != sizeof(head)) {
+        dump_err = errno;
+    }
+    if (close(dump_fd) < 0 && !dump_err) dump_err = errno;
+
+    int err = dump_err;
+    __atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
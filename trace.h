@@ -0,0 +1,94 @@
+/*
+ * PACKET TRACE
+ *
+ * An in-memory ring of the last packet events: what was sent, resent,
+ * acked, received, found corrupt or dropped, when, and the header it
+ * had. Recording one is a clock read, an atomic increment to claim a
+ * slot and a 40 byte copy, with no locks and no system calls, so it
+ * can stay on where --debug's fprintf per packet would change the
+ * timing it's meant to show. Any thread may record into the ring, and
+ * the oldest events are overwritten once it's full.
+ *
+ * trace_dump writes the ring out, oldest first. It only uses system
+ * calls that are safe in a signal handler, so trace_open sets it up to
+ * happen on SIGUSR2 and on crashes, while the event loop carries on or
+ * after it has stopped for good. A path ending in ".pcap" or ".pcapng"
+ * gets pcapng, with each event as a raw IPv4/UDP packet holding the
+ * header, which Wireshark reads. Anything else gets the records
+ * themselves, after a trace_file_t, in host byte order.
+ */
+
+#include <stdint.h>
+
+enum {
+    TRACE_SEND,		/* data packet sent for the first time */
+    TRACE_RETX,		/* data packet sent again */
+    TRACE_ACK,		/* ack sent */
+    TRACE_RECV,		/* packet received */
+    TRACE_BAD,		/* received packet failed its length or checksum */
+    TRACE_DROP,		/* sent packet dropped on purpose (-r) */
+    TRACE_EVENTS
+};
+
+typedef struct trace_rec {
+    uint64_t stamp;	/* position in the ring + 1, once written */
+    uint64_t ns;	/* CLOCK_MONOTONIC */
+    uint32_t ackno;	/* header, in network byte order */
+    uint32_t seqno;
+    uint16_t cksum;
+    uint16_t len;
+    uint32_t addr;	/* peer IPv4 address and port, network byte */
+    uint16_t port;	/* order, or 0 */
+    uint16_t size;	/* bytes on the wire */
+    uint8_t event;
+} trace_rec_t;
+
+typedef struct trace_file {
+    char magic[8];	/* "RELTRACE" */
+    uint32_t rec_size;	/* sizeof (trace_rec_t) */
+    uint32_t count;	/* records that follow */
+    int64_t realtime;	/* add to ns for CLOCK_REALTIME */
+    uint32_t addr;	/* our IPv4 address and port, see trace_local */
+    uint16_t port;
+} trace_file_t;
+
+extern trace_rec_t* trace_ring;
+
+/**
+ * Returns non-zero if events are being recorded, so callers can skip
+ * collecting them otherwise.
+ */
+
+static inline int trace_on(void)
+{
+    return trace_ring != 0;
+}
+
+/**
+ * Starts recording the last entries (a power of two) events, to be
+ * dumped to path on SIGUSR2 or a crash. Returns -1, with errno set, if
+ * there's no memory for the ring.
+ */
+
+int trace_open(const char* path, int entries);
+
+/**
+ * Sets the address our side of the packets comes from in the dump.
+ */
+
+void trace_local(uint32_t addr, uint16_t port);
+
+/**
+ * Records event for the n byte packet pkt (in network byte order), to
+ * or from the peer at addr:port.
+ */
+
+void trace_record(int event, const void* pkt, int n,
+                  uint32_t addr, uint16_t port);
+
+/**
+ * Writes the ring to path. Returns -1, with errno set, on failure, or
+ * if another dump is going on.
+ */
+
+int trace_dump(const char* path);
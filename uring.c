@@ -0,0 +1,174 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags, const void *arg, size_t argsz)
+{
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+		  flags, arg, argsz);
+}
+
+int
+uring_init (struct uring *u, unsigned entries)
+{
+  struct io_uring_params p;
+
+  memset (u, 0, sizeof (*u));
+  memset (&p, 0, sizeof (p));
+  u->fd = -1;
+
+  if ((u->fd = sys_io_uring_setup (entries, &p)) < 0)
+    return -1;
+
+  /* We wait with a timeout through IORING_ENTER_EXT_ARG, and map the
+   * SQ and CQ rings in one go. */
+  if (!(p.features & IORING_FEAT_EXT_ARG)
+      || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close (u->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (u->cq_ring_size > u->sq_ring_size)
+    u->sq_ring_size = u->cq_ring_size;
+  u->sq_ring = mmap (NULL, u->sq_ring_size, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED)
+    goto fail;
+  u->cq_ring = u->sq_ring;
+
+  u->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  u->sqes = mmap (NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    munmap (u->sq_ring, u->sq_ring_size);
+    goto fail;
+  }
+
+  u->sq_head = u->sq_ring + p.sq_off.head;
+  u->sq_tail = u->sq_ring + p.sq_off.tail;
+  u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+  u->sq_array = u->sq_ring + p.sq_off.array;
+  u->sq_entries = p.sq_entries;
+
+  u->cq_head = u->cq_ring + p.cq_off.head;
+  u->cq_tail = u->cq_ring + p.cq_off.tail;
+  u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+  u->cqes = u->cq_ring + p.cq_off.cqes;
+  return 0;
+
+ fail:
+  close (u->fd);
+  u->fd = -1;
+  return -1;
+}
+
+void
+uring_exit (struct uring *u)
+{
+  if (u->fd < 0)
+    return;
+  munmap (u->sqes, u->sqes_size);
+  munmap (u->sq_ring, u->sq_ring_size);
+  close (u->fd);
+  u->fd = -1;
+}
+
+int
+uring_register_buffer (struct uring *u, void *buf, size_t len)
+{
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return syscall (__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+		  &iov, 1);
+}
+
+struct io_uring_sqe *
+uring_get_sqe (struct uring *u)
+{
+  unsigned head = __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *u->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if (tail - head >= u->sq_entries) {
+    /* Full: hand the queued batch to the kernel to make room. */
+    if (uring_submit_wait (u, 0, 0) < 0)
+      return NULL;
+    head = __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= u->sq_entries)
+      return NULL;
+  }
+
+  sqe = &u->sqes[tail & *u->sq_mask];
+  memset (sqe, 0, sizeof (*sqe));
+  u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+  __atomic_store_n (u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  u->sq_queued++;
+  return sqe;
+}
+
+int
+uring_submit_wait (struct uring *u, unsigned wait_nr, long timeout_ms)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = 0;
+  int n;
+
+  memset (&arg, 0, sizeof (arg));
+  if (wait_nr) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+      arg.ts = (unsigned long) &ts;
+    }
+  }
+  else if (!u->sq_queued)
+    return 0;
+
+  n = sys_io_uring_enter (u->fd, u->sq_queued, wait_nr,
+			  flags | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+  if (n < 0) {
+    /* A timeout or a signal just means there was nothing to reap. */
+    if (errno == ETIME || errno == EINTR)
+      return 0;
+    return -1;
+  }
+  u->sq_queued -= n;
+  return n;
+}
+
+struct io_uring_cqe *
+uring_peek_cqe (struct uring *u)
+{
+  unsigned head = *u->cq_head;
+
+  if (head == __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &u->cqes[head & *u->cq_mask];
+}
+
+void
+uring_cqe_seen (struct uring *u)
+{
+  __atomic_store_n (u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
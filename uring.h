@@ -0,0 +1,56 @@
+/* Minimal io_uring wrapper used by rlib's io_uring backend.
+ *
+ * Talks to the kernel directly through the io_uring_setup,
+ * io_uring_enter and io_uring_register system calls, so it needs no
+ * library beyond the kernel headers.  Only what rlib uses is here:
+ * one ring, SQEs filled in by the caller, batched submission, waiting
+ * with a timeout, and a single registered buffer. */
+
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned sq_queued;		/* SQEs filled in but not yet submitted */
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+/* Set up a ring with room for entries submissions.  Returns 0, or -1
+ * with errno set if the kernel has no (usable) io_uring support. */
+int uring_init (struct uring *u, unsigned entries);
+void uring_exit (struct uring *u);
+
+/* Register one buffer, to be referred to as buf_index 0 by the
+ * IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED requests. */
+int uring_register_buffer (struct uring *u, void *buf, size_t len);
+
+/* Returns a zeroed SQE to fill in, submitting what is already queued
+ * first if the submission ring is full. */
+struct io_uring_sqe *uring_get_sqe (struct uring *u);
+
+/* Submit everything queued, then wait until at least wait_nr
+ * completions are available or timeout_ms milliseconds pass (a
+ * negative timeout waits forever).  Returns the number of SQEs
+ * submitted, or -1 with errno set. */
+int uring_submit_wait (struct uring *u, unsigned wait_nr, long timeout_ms);
+
+/* Iterate over completions: peek returns the oldest unseen CQE or
+ * NULL, and seen hands it back to the kernel. */
+struct io_uring_cqe *uring_peek_cqe (struct uring *u);
+void uring_cqe_seen (struct uring *u);